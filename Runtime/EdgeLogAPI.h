@@ -0,0 +1,44 @@
+//===-- EdgeLogAPI.h - Edge log runtime interface -----------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Functions that an instrumented program can call to control the edge log
+/// runtime. They are declared weak, so that the program still links when it
+/// is not instrumented (in which case they are null, and should not be
+/// called).
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef EDGE_LOG_API_H
+#define EDGE_LOG_API_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Start logging edges (if logging is stopped)
+void __edge_log_start(void) __attribute__((weak));
+
+/// Stop logging edges. Modules instrumented with `-edge-log-toggle` then run
+/// at nearly full speed. Other modules still call into the runtime (which
+/// discards their blocks).
+void __edge_log_stop(void) __attribute__((weak));
+
+/// Mark the start of a request on the calling thread (ending its previous
+/// request, if any). When sampling by request (see `EDGE_LOG_SAMPLE`), one in
+/// every N requests is sampled: the calling thread logs a burst of blocks until
+/// its next request, independently of other threads. Threads only log blocks
+/// while in a sampled request. Has no effect when not sampling by request.
+void __edge_log_request(void) __attribute__((weak));
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // EDGE_LOG_API_H
@@ -0,0 +1,182 @@
+//===-- EdgeLogFormat.h - Binary edge log format ------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// The binary edge log format, shared by the runtime (which writes it) and the
+/// edge log reader.
+///
+/// A log starts with a magic string and a format version, followed by a
+/// sequence of records. Each record starts with a one-byte record kind:
+///
+///  * `Module`: an instrumented module, written once before any chunk that
+///    refers to it. Contains the module ID (a small integer, local to the log)
+///    and the module hash (the upper 32 bits of the IDs of its blocks). Module
+///    ID 0 is reserved for "no block" (the predecessor of a thread's first
+///    block).
+///  * `Chunk`: a sequence of basic blocks executed by a single thread.
+///    Contains the number of blocks, the block executed before the first one
+///    (the source of the first edge) and the blocks themselves.
+///  * `PackedChunk`: a chunk stored in columns, so that it can be decoded in
+///    bulk. Contains the number of blocks and the block executed before the
+///    first one (as in a `Chunk`), followed by the number of runs of blocks
+///    in the same module and each run's module ID and length, and finally the
+///    (zigzag-encoded) local ID deltas of all blocks, in stream-vbyte format
+///    (see `EncodeStreamVByte`).
+///  * `RawChunk`: an unencoded chunk (see `RawChunkHeader`), written when the
+///    runtime logs straight to a memory-mapped log. Raw chunks do not refer to
+///    module records.
+///
+/// Zero bytes between records are padding.
+///
+/// Blocks are encoded as a module ID followed by the (zigzag-encoded)
+/// difference between the block's local ID (the lower 32 bits of its ID) and
+/// the previous local ID seen in the same module. Delta state is reset at the
+/// start of every chunk, so that chunks can be decoded independently. The
+/// chunk's `Prev` block is encoded as a module ID and an absolute local ID.
+/// In packed chunks, deltas wrap around at 32 bits.
+///
+/// A chunk may contain breaks (see `kBreakID`, encoded as a block in module 0)
+/// where logging was interrupted (e.g., between sampled bursts). A break is
+/// not a block: the block after it has no predecessor.
+///
+/// Unless stated otherwise, integers are unsigned LEB128 varints.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef EDGE_LOG_FORMAT_H
+#define EDGE_LOG_FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace edgelog {
+
+static const char kMagic[8] = {'E', 'D', 'G', 'E', 'L', 'O', 'G', '\0'};
+static const std::uint32_t kVersion = 4;
+
+/// Oldest version that can still be read
+static const std::uint32_t kMinVersion = 2;
+
+/// A "block ID" that ends a thread's sequence of blocks (e.g., where logging
+/// was stopped, or at the start of a sampled burst), so that no edge is
+/// recorded between the blocks either side of it. No block has this ID, as
+/// module hashes are never 0.
+static const std::uint64_t kBreakID = 1;
+
+/// Maximum encoded size of a 64-bit varint
+static const std::size_t kMaxVarIntSize = 10;
+
+enum RecordKind : std::uint8_t {
+  RK_Padding = 0,
+  RK_Module = 1,
+  RK_Chunk = 2,
+  RK_RawChunk = 3,
+  RK_PackedChunk = 4,
+};
+
+/// Value of `RawChunkHeader::Size` until the chunk is complete. The blocks
+/// logged so far are those before the first zero block ID.
+static const std::uint64_t kUnknownSize = UINT64_MAX;
+
+/// The header of a raw chunk, followed by `Capacity` block IDs. Raw chunks
+/// (and all of their fields) are 8-byte aligned in the log, and integers are
+/// little-endian.
+struct RawChunkHeader {
+  std::uint8_t Kind;
+  std::uint8_t Padding[7];
+  /// The block executed before the first block in the chunk
+  std::uint64_t Prev;
+  std::uint64_t Capacity;
+  /// The number of blocks in the chunk, or `kUnknownSize`
+  std::uint64_t Size;
+};
+
+/// Encode `V` at `Buf`, returning a pointer past the encoded value
+static inline std::uint8_t *EncodeVarInt(std::uint64_t V, std::uint8_t *Buf) {
+  while (V >= 0x80) {
+    *Buf++ = static_cast<std::uint8_t>(V) | 0x80;
+    V >>= 7;
+  }
+  *Buf++ = static_cast<std::uint8_t>(V);
+  return Buf;
+}
+
+/// Decode a varint from [`Buf`, `End`) into `V`, returning a pointer past the
+/// encoded value (or null if the encoding is truncated or malformed)
+static inline const std::uint8_t *
+DecodeVarInt(const std::uint8_t *Buf, const std::uint8_t *End,
+             std::uint64_t &V) {
+  V = 0;
+  for (unsigned Shift = 0; Buf < End && Shift < 64; Shift += 7) {
+    const std::uint8_t Byte = *Buf++;
+    V |= static_cast<std::uint64_t>(Byte & 0x7f) << Shift;
+    if (!(Byte & 0x80)) {
+      return Buf;
+    }
+  }
+  return nullptr;
+}
+
+static inline std::uint64_t ZigZagEncode(std::int64_t V) {
+  return (static_cast<std::uint64_t>(V) << 1) ^
+         static_cast<std::uint64_t>(V >> 63);
+}
+
+static inline std::int64_t ZigZagDecode(std::uint64_t V) {
+  return static_cast<std::int64_t>(V >> 1) ^ -static_cast<std::int64_t>(V & 1);
+}
+
+static inline std::uint32_t ZigZagEncode32(std::int32_t V) {
+  return (static_cast<std::uint32_t>(V) << 1) ^
+         static_cast<std::uint32_t>(V >> 31);
+}
+
+static inline std::int32_t ZigZagDecode32(std::uint32_t V) {
+  return static_cast<std::int32_t>(V >> 1) ^ -static_cast<std::int32_t>(V & 1);
+}
+
+/// Maximum stream-vbyte encoded size of `N` values
+static inline std::size_t MaxStreamVByteSize(std::size_t N) {
+  return (N + 3) / 4 + 4 * N;
+}
+
+/// Encode the `N` values at `Values` at `Buf` in stream-vbyte format,
+/// returning a pointer past the encoded values.
+///
+/// Values are stored in as few (little-endian) bytes as possible, after a
+/// control byte per four values that holds the number of bytes (minus one) of
+/// each of them, two bits per value, starting from the least significant
+/// bits. All control bytes come first, so that values can be decoded four at
+/// a time with a single shuffle.
+static inline std::uint8_t *EncodeStreamVByte(const std::uint32_t *Values,
+                                              std::size_t N,
+                                              std::uint8_t *Buf) {
+  std::uint8_t *Control = Buf;
+  std::uint8_t *Data = Buf + (N + 3) / 4;
+
+  for (std::size_t I = 0; I < N; ++I) {
+    std::uint32_t V = Values[I];
+    const unsigned Len = V < (1U << 8) ? 1 : V < (1U << 16) ? 2
+                                           : V < (1U << 24) ? 3
+                                                            : 4;
+    if (I % 4 == 0) {
+      Control[I / 4] = 0;
+    }
+    Control[I / 4] |= (Len - 1) << (2 * (I % 4));
+    for (unsigned J = 0; J < Len; ++J, V >>= 8) {
+      *Data++ = static_cast<std::uint8_t>(V);
+    }
+  }
+
+  return Data;
+}
+
+} // namespace edgelog
+
+#endif // EDGE_LOG_FORMAT_H
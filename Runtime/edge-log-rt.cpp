@@ -1,71 +1,2099 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#include <dlfcn.h>
+#include <cstring>
+#include <cstdarg>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <zlib.h>
 
-using Edge = std::pair<std::uintptr_t, std::uintptr_t>;
-using EdgeVector = std::vector<Edge>;
+#include "EdgeLogFormat.h"
 
 const char *const kEdgeLogEnv = "EDGE_LOG_PATH";
 const char *const kEnableGZipEnv = "EDGE_LOG_GZIP";
+const char *const kLogFormatEnv = "EDGE_LOG_FORMAT";
+const char *const kEnableStreamEnv = "EDGE_LOG_STREAM";
+const char *const kBufferSizeEnv = "EDGE_LOG_BUFFER_SIZE";
+const char *const kLogModeEnv = "EDGE_LOG_MODE";
+const char *const kGZipThreadsEnv = "EDGE_LOG_GZIP_THREADS";
+const char *const kLogStoppedEnv = "EDGE_LOG_STOPPED";
+const char *const kToggleSignalEnv = "EDGE_LOG_TOGGLE_SIGNAL";
+const char *const kSampleEnv = "EDGE_LOG_SAMPLE";
+const char *const kSampleBurstEnv = "EDGE_LOG_SAMPLE_BURST";
 
-static EdgeVector *Edges;
-static __thread std::uintptr_t PrevBB;
+/// Default streaming buffer budget (in MiB)
+static constexpr std::size_t kDefaultBufferSize = 64;
 
+/// Default number of blocks each thread logs per sampled burst
+static constexpr std::size_t kDefaultSampleBurst = 10000;
+
+/// Amount of (uncompressed) output compressed independently by each gzip
+/// worker
+static constexpr std::size_t kGZipBlockSize = 1 << 20;
+
+/// Number of executed basic blocks held by a single buffer chunk
+static constexpr std::size_t kChunkEntries = 1 << 16;
+
+/// Number of slots in the first table of the unique edge set
+static constexpr std::size_t kEdgeSetInitialSize = 1 << 12;
+
+/// Number of recently-inserted edges each thread remembers (in unique mode)
+static constexpr std::size_t kRecentEdges = 64;
+
+/// Number of chunks in each extent of a memory-mapped log
+static constexpr std::size_t kExtentChunks = 4;
+
+/// Size of a raw chunk in a memory-mapped log
+static constexpr std::size_t kRawChunkSize =
+    sizeof(edgelog::RawChunkHeader) + kChunkEntries * sizeof(std::uint64_t);
+
+/// Maximum number of modules in a log written after a fatal signal
+static constexpr std::size_t kMaxCrashModules = 1 << 14;
+
+/// Signals that terminate the process without running destructors, after
+/// which the log is written from the signal handler
+static const int kFatalSignals[] = {SIGABRT, SIGBUS,  SIGFPE, SIGILL,
+                                    SIGINT,  SIGSEGV, SIGTERM};
+
+/// A fixed-size chunk of a thread's edge buffer.
+///
+/// Only the executed basic blocks (i.e., their IDs) are stored: the source of
+/// each edge is the preceding entry (or `Prev` for the first entry in the
+/// chunk). A chunk is only ever appended to by the thread that owns it, through
+/// the thread's cursor. `Size` is only published when the chunk is full, or
+/// when the log is written (see `SyncChunk`), so the hot path needs no
+/// synchronization.
+struct EdgeChunk {
+  std::atomic<EdgeChunk *> Next;
+  std::uint64_t Prev;
+  std::atomic<std::size_t> Size;
+  std::uint64_t Blocks[kChunkEntries];
+};
+
+/// Whether a thread is running (with its cursor being read by another thread),
+/// or has exited (see `ThreadBuffer::State`)
+enum ThreadStatus { TS_Running, TS_Reading, TS_Exited };
+
+/// The chunks logged by a single thread. Thread buffers are registered in a
+/// lock-free list and are never freed, so edges logged by threads that have
+/// already exited are still written at exit.
+///
+/// When streaming, `Head` only holds the chunks not yet handed to the writer
+/// thread, and is protected by the stream lock. When logging to a mapped log,
+/// the thread's chunks are in the log itself, and `Head` is unused.
+struct ThreadBuffer {
+  ThreadBuffer *Next;
+  EdgeChunk *Head;
+
+  /// The chunk the thread is currently logging to
+  std::atomic<EdgeChunk *> Current;
+
+  /// The raw chunk the thread is currently logging to in a mapped log, and
+  /// where the next chunk goes in the thread's current extent
+  std::atomic<edgelog::RawChunkHeader *> Mapped;
+  std::uint8_t *Extent;
+  std::uint8_t *ExtentPos;
+
+  /// The block to start the thread's next mapped chunk after, if it has no
+  /// current chunk (e.g., after a fork)
+  std::uint64_t Prev;
+
+  /// Where the thread's blocks go if the mapped log cannot be extended (they
+  /// are discarded)
+  std::uint64_t *Discard;
+
+  /// The thread's cursor (see `ThreadState`). Its thread-locals are freed
+  /// once the thread exits, so other threads only read it while holding
+  /// `State` at `TS_Reading`, which the exiting thread waits on.
+  std::uint64_t **Cursor;
+  std::atomic<int> State;
+};
+
+/// Writes edges to the output log
+class EdgeWriter {
+public:
+  virtual ~EdgeWriter() = default;
+
+  /// Write the edges in a chunk
+  virtual void write(const EdgeChunk *Chunk) = 0;
+
+  /// Flush buffered output (before forking, so that the child does not write
+  /// it again when it exits)
+  virtual void flush() = 0;
+
+  /// Write the edges in a chain of chunks
+  void writeChain(const EdgeChunk *Chunk) {
+    for (; Chunk; Chunk = Chunk->Next.load(std::memory_order_acquire)) {
+      write(Chunk);
+    }
+  }
+};
+
+/// Hands full chunks to a background thread that writes them to the log, so
+/// that memory use is bounded by the buffer budget rather than by the length
+/// of the run.
+class EdgeStream {
+public:
+  EdgeStream(EdgeWriter *W, std::size_t Max)
+      : Writer(W), MaxChunks(Max), Flusher(&EdgeStream::run, this) {}
+
+  /// Queue the chunks in `Buf` for writing and install an empty chunk
+  /// (starting after `Prev`) to continue logging in. Only blocks if the
+  /// buffer budget is exhausted. Returns null if the stream is already closed.
+  EdgeChunk *handOff(ThreadBuffer *Buf, std::uint64_t Prev);
+
+  /// Count a thread's first chunk against the buffer budget
+  void addChunk() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    ++NumChunks;
+  }
+
+  /// Write the chunks still held by all threads and wait for the writer
+  void close(ThreadBuffer *Bufs);
+
+  /// Wait for the writer to be idle and flush the log before forking. The
+  /// stream stays locked until `unlockAfterFork` (in the parent); the child
+  /// abandons the stream.
+  void lockForFork();
+  void unlockAfterFork() { Mutex.unlock(); }
+
+private:
+  void run();
+
+  EdgeWriter *Writer;
+  const std::size_t MaxChunks;
+  std::size_t NumChunks = 0;
+  bool Closing = false;
+  bool Writing = false;
+
+  std::mutex Mutex;
+  std::condition_variable WorkReady;
+  std::condition_variable ChunkFree;
+  std::condition_variable WriterIdle;
+  std::deque<EdgeChunk *> Pending;
+  std::vector<EdgeChunk *> FreeChunks;
+
+  std::thread Flusher;
+};
+
+/// The set of distinct edges executed by all threads (in unique mode). Full
+/// chunks are inserted by the thread that logged them, which then reuses the
+/// chunk, so memory use scales with the number of distinct edges rather than
+/// with the length of the run.
+///
+/// Edges are inserted without locking into an open-addressed table of
+/// pointers to (immutable) edges. When a table is half full, a table twice its
+/// size is chained after it. Older tables are still searched, but only the
+/// newest table is inserted into. Two threads racing to insert the same edge
+/// as a table grows may both succeed, so duplicates are removed on output.
+class EdgeSet {
+public:
+  EdgeSet() : Tables(new Table(kEdgeSetInitialSize)) {}
+
+  /// Insert the edges in a chunk
+  void insert(const EdgeChunk *Chunk);
+
+  /// Write the edges in the set (in order)
+  void write(EdgeWriter *Writer) const;
+
+  /// Call `Fn(Prev, Cur)` for each edge in the set (some possibly more than
+  /// once). Does not allocate, so can be called from a signal handler.
+  template <typename FnT> void forEach(FnT Fn) const {
+    for (const Table *T = Tables; T;
+         T = T->Next.load(std::memory_order_acquire)) {
+      for (std::size_t I = 0; I <= T->Mask; ++I) {
+        if (const Edge *E = T->Slots[I].load(std::memory_order_acquire)) {
+          Fn(E->Prev, E->Cur);
+        }
+      }
+    }
+  }
+
+private:
+  struct Edge {
+    std::uint64_t Prev;
+    std::uint64_t Cur;
+  };
+
+  struct Table {
+    explicit Table(std::size_t Size)
+        : Mask(Size - 1), Slots(new std::atomic<const Edge *>[Size]()) {}
+
+    const std::size_t Mask;
+    std::atomic<std::size_t> NumEdges{0};
+    std::atomic<Table *> Next{nullptr};
+    std::unique_ptr<std::atomic<const Edge *>[]> Slots;
+  };
+
+  void insert(std::uint64_t Prev, std::uint64_t Cur, std::uint64_t Hash);
+  Table *grow(Table *T);
+
+  /// The first (and smallest) table
+  Table *const Tables;
+};
+
+/// A binary log that threads log to directly, through a shared memory mapping,
+/// so that blocks go straight into the page cache. Nothing is left to write
+/// at exit (beyond publishing the size of each thread's last chunk), and the
+/// log survives the process being killed.
+///
+/// The log grows in extents of a few raw chunks, each of which is mapped by a
+/// single thread. A thread's full extents are unmapped by the next thread to
+/// map an extent, to keep its address space bounded.
+class MappedLog {
+public:
+  static MappedLog *open(const char *LogPath);
+
+  /// Map a new extent, retiring the (full) extent `Old` (if any). Returns null
+  /// if the log cannot be extended.
+  std::uint8_t *mapExtent(std::uint8_t *Old);
+
+  /// Unmap `Extent` (once another extent is mapped), as its thread has exited
+  void retire(std::uint8_t *Extent);
+
+  /// Append the chain of (heap) chunks starting at `Head` to the log
+  void append(const EdgeChunk *Head);
+
+  std::size_t getExtentSize() const { return ExtentSize; }
+
+private:
+  MappedLog(int F, std::size_t Size, off_t Offset)
+      : FD(F), ExtentSize(Size), FileSize(Offset) {}
+
+  const int FD;
+  const std::size_t ExtentSize;
+
+  std::mutex Mutex;
+  off_t FileSize;
+  std::vector<std::uint8_t *> Retired;
+};
+
+/// A module's edge counters, registered by counts-mode instrumentation. Edges
+/// are stored as consecutive (source, destination) ID pairs: the first
+/// `NumCounters` edges are counted, and the counts of the remaining edges (a
+/// spanning tree of each function's CFG) are derived from them. ID 0 is a
+/// function's entry or exit.
+struct CounterTable {
+  const std::uint64_t *Counters;
+  const std::uint64_t *Edges;
+  std::size_t NumCounters;
+  std::size_t NumEdges;
+};
+
+static std::atomic<ThreadBuffer *> ThreadBuffers;
+static EdgeStream *Stream;
+static EdgeSet *UniqueEdges;
+static MappedLog *Log;
+static std::mutex CounterTablesMutex;
+static std::vector<CounterTable> *CounterTables;
+
+/// Set in forked child processes
+static bool Forked;
+
+/// Where (and in which format) to write the log after a fatal signal.
+/// Computed ahead of time, as the signal handler cannot allocate.
+static char CrashLogPath[4096];
+static bool CrashLogBinary;
+
+/// Set once the log is being written (at exit, or after a fatal signal)
+static std::atomic<bool> LogWritten;
+
+static __thread ThreadBuffer *CurBuffer
+    __attribute__((tls_model("initial-exec")));
+
+/// The last logging generation started (see `__edge_log_generation`)
+static std::atomic<std::uint32_t> LastGeneration{1};
+
+/// Set when sampling bursts of blocks (see `EDGE_LOG_SAMPLE`)
+static bool Sampling;
+
+/// Maximum number of blocks each thread logs per generation (i.e., burst)
+static std::size_t SampleBurst = SIZE_MAX;
+
+/// Time between bursts (in ms) when sampling by time, and the number of
+/// requests per burst when sampling by request
+static unsigned long SamplePeriod;
+static unsigned long SampleRequests;
+
+/// Number of requests started (see `__edge_log_request`)
+static std::atomic<unsigned long> Requests;
+
+/// Number of threads in a sampled request. Logging is only started while it is
+/// non-zero when sampling by request.
+static std::mutex SampledThreadsMutex;
+static unsigned long SampledThreads;
+
+/// Set while logging is stopped by the program (with `__edge_log_stop`,
+/// `EDGE_LOG_STOPPED` or the toggle signal), so that sampling does not start
+/// it again
+static std::atomic<bool> Stopped;
+
+/// A thread's logging state, in a single cache line. Inline instrumentation
+/// accesses `Cursor`, `End` and `Generation` directly (so their layout must
+/// match the pass's), computing the address of the calling thread's state
+/// once per function.
+struct alignas(64) ThreadState {
+  /// Where the thread logs its next block, and where it must next call into
+  /// the runtime (the end of its current chunk, or of its burst if that comes
+  /// first). The thread calls `__edge_log` when they are equal.
+  std::uint64_t *Cursor;
+  std::uint64_t *End;
+
+  /// The generation the thread last logged in (0 if it has not logged)
+  std::uint32_t Generation;
+
+  /// The end of the thread's current chunk, and the number of blocks left in
+  /// its burst beyond `End`
+  std::uint64_t *ChunkEnd;
+  std::size_t BurstLeft;
+
+  /// Set while the thread is in a sampled request (when sampling by request)
+  bool InSampledRequest;
+};
+
+/// The runtime's thread-locals are initial-exec: they are at a fixed offset
+/// from the thread pointer, rather than looked up with `__tls_get_addr` (as
+/// they otherwise would be, as the runtime is built position-independent).
+/// This only fails if a library linked with the runtime is loaded with
+/// `dlopen` once the space reserved for such libraries has run out.
+extern "C" {
+__thread ThreadState __edge_log_thread
+    __attribute__((tls_model("initial-exec")));
+}
+
+/// The logging generation: 0 while logging is stopped, and a new (non-zero)
+/// value each time logging is started. Toggleable instrumentation (see
+/// `-edge-log-toggle`) checks it before logging a block. A thread that last
+/// logged in an earlier generation logs a break before its next block, so
+/// that no edge spans the time logging was stopped.
+extern "C" {
+std::uint32_t __edge_log_generation = 1;
+}
+
+static void ResetChunk(EdgeChunk *Chunk, std::uint64_t Prev) {
+  Chunk->Next.store(nullptr, std::memory_order_relaxed);
+  Chunk->Prev = Prev;
+  Chunk->Size.store(0, std::memory_order_relaxed);
+}
+
+/// Publish the size of the chunk that `Buf`'s thread is currently logging to,
+/// given the thread's cursor `Pos`. The thread may still be running, so its
+/// cursor is only trusted if it points into its current chunk.
+static void PublishChunkSize(ThreadBuffer *Buf, const std::uint64_t *Pos) {
+  if (EdgeChunk *Chunk = Buf->Current.load(std::memory_order_acquire)) {
+    if (Pos >= Chunk->Blocks && Pos <= Chunk->Blocks + kChunkEntries) {
+      Chunk->Size.store(Pos - Chunk->Blocks, std::memory_order_release);
+    }
+  } else if (edgelog::RawChunkHeader *Raw =
+                 Buf->Mapped.load(std::memory_order_acquire)) {
+    const std::uint64_t *Blocks = reinterpret_cast<std::uint64_t *>(Raw + 1);
+    if (Pos >= Blocks && Pos <= Blocks + kChunkEntries) {
+      __atomic_store_n(&Raw->Size, Pos - Blocks, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+/// Publish the size of the chunk that `Buf`'s thread is currently logging to,
+/// unless the thread has exited (in which case it published it itself)
+static void SyncChunk(ThreadBuffer *Buf) {
+  int Expected = TS_Running;
+  if (!Buf->State.compare_exchange_strong(Expected, TS_Reading,
+                                          std::memory_order_acquire)) {
+    return;
+  }
+
+  PublishChunkSize(Buf, *static_cast<std::uint64_t *volatile *>(Buf->Cursor));
+  Buf->State.store(TS_Running, std::memory_order_release);
+}
+
+MappedLog *MappedLog::open(const char *LogPath) {
+  const int FD = ::open(LogPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (FD < 0) {
+    return nullptr;
+  }
+
+  // The header has a page to itself, so that extents are page-aligned. The
+  // rest of the page is padding.
+  const std::size_t PageSize = sysconf(_SC_PAGESIZE);
+  std::uint8_t Header[sizeof(edgelog::kMagic) + edgelog::kMaxVarIntSize];
+  std::memcpy(Header, edgelog::kMagic, sizeof(edgelog::kMagic));
+  const std::uint8_t *End = edgelog::EncodeVarInt(
+      edgelog::kVersion, Header + sizeof(edgelog::kMagic));
+  if (pwrite(FD, Header, End - Header, 0) != End - Header ||
+      ftruncate(FD, PageSize)) {
+    ::close(FD);
+    return nullptr;
+  }
+
+  const std::size_t ExtentSize =
+      (kExtentChunks * kRawChunkSize + PageSize - 1) / PageSize * PageSize;
+  return new MappedLog(FD, ExtentSize, PageSize);
+}
+
+std::uint8_t *MappedLog::mapExtent(std::uint8_t *Old) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  for (std::uint8_t *Extent : Retired) {
+    munmap(Extent, ExtentSize);
+  }
+  Retired.clear();
+  if (Old) {
+    Retired.push_back(Old);
+  }
+
+  // The file is extended sparsely, so unused space in extents costs nothing
+  if (ftruncate(FD, FileSize + ExtentSize)) {
+    return nullptr;
+  }
+  void *Extent = mmap(nullptr, ExtentSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      FD, FileSize);
+  if (Extent == MAP_FAILED) {
+    return nullptr;
+  }
+
+  FileSize += ExtentSize;
+  return static_cast<std::uint8_t *>(Extent);
+}
+
+void MappedLog::retire(std::uint8_t *Extent) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Retired.push_back(Extent);
+}
+
+void MappedLog::append(const EdgeChunk *Head) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  for (const EdgeChunk *Chunk = Head; Chunk;
+       Chunk = Chunk->Next.load(std::memory_order_acquire)) {
+    edgelog::RawChunkHeader Header;
+    memset(&Header, 0, sizeof(Header));
+    Header.Kind = edgelog::RK_RawChunk;
+    Header.Prev = Chunk->Prev;
+    Header.Capacity = Header.Size = Chunk->Size.load(std::memory_order_acquire);
+
+    const std::size_t BlocksSize = Header.Size * sizeof(std::uint64_t);
+    if (pwrite(FD, &Header, sizeof(Header), FileSize) != sizeof(Header) ||
+        pwrite(FD, Chunk->Blocks, BlocksSize, FileSize + sizeof(Header)) !=
+            static_cast<ssize_t>(BlocksSize)) {
+      return;
+    }
+    FileSize += sizeof(Header) + BlocksSize;
+  }
+
+  // Keep extents page-aligned (the gap is padding)
+  const std::size_t PageSize = sysconf(_SC_PAGESIZE);
+  FileSize = (FileSize + PageSize - 1) / PageSize * PageSize;
+}
+
+EdgeChunk *EdgeStream::handOff(ThreadBuffer *Buf, std::uint64_t Prev) {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  if (Closing) {
+    return nullptr;
+  }
+
+  Pending.push_back(Buf->Head);
+  Buf->Head = nullptr;
+  WorkReady.notify_one();
+
+  ChunkFree.wait(Lock, [this]() {
+    return !FreeChunks.empty() || NumChunks < MaxChunks || Closing;
+  });
+
+  EdgeChunk *Chunk;
+  if (!FreeChunks.empty()) {
+    Chunk = FreeChunks.back();
+    FreeChunks.pop_back();
+  } else {
+    Chunk = new EdgeChunk;
+    ++NumChunks;
+  }
+
+  ResetChunk(Chunk, Prev);
+  Buf->Head = Chunk;
+  Buf->Current.store(Chunk, std::memory_order_release);
+  return Chunk;
+}
+
+void EdgeStream::close(ThreadBuffer *Bufs) {
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Closing = true;
+
+    // Other threads may still be running, so their chunks are not recycled
+    for (ThreadBuffer *Buf = Bufs; Buf; Buf = Buf->Next) {
+      SyncChunk(Buf);
+      Pending.push_back(Buf->Head);
+    }
+  }
+
+  WorkReady.notify_one();
+  ChunkFree.notify_all();
+  Flusher.join();
+
+  delete Writer;
+}
+
+void EdgeStream::lockForFork() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  WriterIdle.wait(Lock, [this]() { return !Writing; });
+  Writer->flush();
+  Lock.release();
+}
+
+void EdgeStream::run() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+
+  for (;;) {
+    WorkReady.wait(Lock, [this]() { return !Pending.empty() || Closing; });
+    if (Pending.empty()) {
+      break;
+    }
+
+    EdgeChunk *Chain = Pending.front();
+    Pending.pop_front();
+
+    Writing = true;
+    Lock.unlock();
+    Writer->writeChain(Chain);
+    // Keep the log readable up to here if the process crashes
+    Writer->flush();
+    Lock.lock();
+    Writing = false;
+    WriterIdle.notify_all();
+
+    if (!Closing) {
+      while (Chain) {
+        EdgeChunk *Next = Chain->Next.load(std::memory_order_relaxed);
+        FreeChunks.push_back(Chain);
+        Chain = Next;
+      }
+      ChunkFree.notify_all();
+    }
+  }
+}
+
+static std::uint64_t HashEdge(std::uint64_t Prev, std::uint64_t Cur) {
+  std::uint64_t Hash = Prev * 0x9e3779b97f4a7c15 ^ Cur;
+  Hash ^= Hash >> 32;
+  Hash *= 0xd6e8feb86659fd93;
+  return Hash ^ (Hash >> 32);
+}
+
+/// The edges most recently inserted into the edge set by the calling thread,
+/// indexed by hash. Saves searching the set for edges executed repeatedly
+/// (e.g., in loops).
+static __thread std::uint64_t RecentEdges[kRecentEdges][2]
+    __attribute__((tls_model("initial-exec")));
+
+void EdgeSet::insert(const EdgeChunk *Chunk) {
+  const std::size_t Size = Chunk->Size.load(std::memory_order_acquire);
+  std::uint64_t Prev = Chunk->Prev == edgelog::kBreakID ? 0 : Chunk->Prev;
+
+  for (std::size_t I = 0; I < Size; ++I) {
+    const std::uint64_t Cur = Chunk->Blocks[I];
+    if (Cur == edgelog::kBreakID) {
+      Prev = 0;
+      continue;
+    }
+    const std::uint64_t Hash = HashEdge(Prev, Cur);
+
+    std::uint64_t *Recent = RecentEdges[Hash % kRecentEdges];
+    if (Recent[0] != Prev || Recent[1] != Cur) {
+      insert(Prev, Cur, Hash);
+      Recent[0] = Prev;
+      Recent[1] = Cur;
+    }
+
+    Prev = Cur;
+  }
+}
+
+void EdgeSet::insert(std::uint64_t Prev, std::uint64_t Cur,
+                     std::uint64_t Hash) {
+  Edge *New = nullptr;
+
+  for (Table *T = Tables; T;) {
+    Table *Next = T->Next.load(std::memory_order_acquire);
+
+    for (std::size_t I = Hash & T->Mask;; I = (I + 1) & T->Mask) {
+      const Edge *E = T->Slots[I].load(std::memory_order_acquire);
+      if (!E) {
+        // Not in this table. Only insert into the newest table.
+        if (Next) {
+          break;
+        }
+        if (T->NumEdges.load(std::memory_order_relaxed) >= (T->Mask + 1) / 2) {
+          Next = grow(T);
+          break;
+        }
+
+        if (!New) {
+          New = new Edge{Prev, Cur};
+        }
+        if (T->Slots[I].compare_exchange_strong(E, New,
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+          T->NumEdges.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+      }
+
+      // `E` is either an existing edge, or the edge that won the race for
+      // this slot
+      if (E->Prev == Prev && E->Cur == Cur) {
+        delete New;
+        return;
+      }
+    }
+
+    T = Next;
+  }
+}
+
+EdgeSet::Table *EdgeSet::grow(Table *T) {
+  Table *Bigger = new Table(2 * (T->Mask + 1));
+  Table *Expected = nullptr;
+  if (!T->Next.compare_exchange_strong(Expected, Bigger,
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire)) {
+    delete Bigger;
+    return Expected;
+  }
+  return Bigger;
+}
+
+void EdgeSet::write(EdgeWriter *Writer) const {
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> Edges;
+  forEach([&](std::uint64_t Prev, std::uint64_t Cur) {
+    Edges.emplace_back(Prev, Cur);
+  });
+
+  std::sort(Edges.begin(), Edges.end());
+  Edges.erase(std::unique(Edges.begin(), Edges.end()), Edges.end());
+
+  // Each edge is written as a single-block chunk
+  std::unique_ptr<EdgeChunk> Chunk(new EdgeChunk);
+  Chunk->Size.store(1, std::memory_order_relaxed);
+  for (const auto &E : Edges) {
+    Chunk->Prev = E.first;
+    Chunk->Blocks[0] = E.second;
+    Writer->write(Chunk.get());
+  }
+}
+
+/// Writes edges as CSV rows
+template <typename T, T OpenF(const char *, const char *),
+          int PrintF(T, const char *, ...), int FlushF(T), int CloseF(T)>
+class CSVWriter : public EdgeWriter {
+public:
+  static EdgeWriter *open(const char *LogPath) {
+    T LogFile = OpenF(LogPath, "w");
+    if (!LogFile) {
+      return nullptr;
+    }
+
+    return new CSVWriter(LogFile);
+  }
+
+  ~CSVWriter() override { CloseF(LogFile); }
+
+  void write(const EdgeChunk *Chunk) override {
+    const std::size_t Size = Chunk->Size.load(std::memory_order_acquire);
+    std::uint64_t Prev = Chunk->Prev == edgelog::kBreakID ? 0 : Chunk->Prev;
+
+    for (std::size_t I = 0; I < Size; ++I) {
+      const std::uint64_t Cur = Chunk->Blocks[I];
+      if (Cur == edgelog::kBreakID) {
+        Prev = 0;
+        continue;
+      }
+      PrintF(LogFile, "%" PRIu64 ",%" PRIu64 "\n", Prev, Cur);
+      Prev = Cur;
+    }
+  }
+
+  void flush() override { FlushF(LogFile); }
+
+private:
+  explicit CSVWriter(T File) : LogFile(File) {
+    PrintF(LogFile, "prev_id,cur_id\n");
+  }
+
+  T LogFile;
+};
+
+/// Writes edges in the binary log format (see EdgeLogFormat.h)
+template <typename T, T OpenF(const char *, const char *),
+          int WriteF(T, const void *, unsigned), int FlushF(T), int CloseF(T)>
+class BinaryWriter : public EdgeWriter {
+public:
+  static EdgeWriter *open(const char *LogPath) {
+    T LogFile = OpenF(LogPath, "wb");
+    if (!LogFile) {
+      return nullptr;
+    }
+
+    return new BinaryWriter(LogFile);
+  }
+
+  ~BinaryWriter() override { CloseF(LogFile); }
+
+  /// Write the chunk as a packed chunk: the module of each block is stored
+  /// as runs, and local ID deltas in stream-vbyte format
+  void write(const EdgeChunk *Chunk) override {
+    const std::size_t Size = Chunk->Size.load(std::memory_order_acquire);
+
+    Runs.clear();
+    Deltas.resize(Size);
+    LastIDs.assign(ModuleIDs.size() + 1, 0);
+
+    for (std::size_t I = 0; I < Size; ++I) {
+      const std::uint64_t ID = Chunk->Blocks[I];
+      const std::uint32_t LocalID = static_cast<std::uint32_t>(ID);
+      const std::uint64_t Module = ID >> 32 ? getModule(ID >> 32) : 0;
+
+      if (Runs.empty() || Runs.back().first != Module) {
+        Runs.emplace_back(Module, 0);
+      }
+      ++Runs.back().second;
+
+      Deltas[I] = edgelog::ZigZagEncode32(
+          static_cast<std::int32_t>(LocalID - LastIDs[Module]));
+      LastIDs[Module] = LocalID;
+    }
+
+    Buf.resize(1 + (2 * Runs.size() + 4) * edgelog::kMaxVarIntSize +
+               edgelog::MaxStreamVByteSize(Size));
+
+    std::uint8_t *P = Buf.data();
+    *P++ = edgelog::RK_PackedChunk;
+    P = edgelog::EncodeVarInt(Size, P);
+    P = encodeBlock(Chunk->Prev, P);
+    P = edgelog::EncodeVarInt(Runs.size(), P);
+    for (const auto &Run : Runs) {
+      P = edgelog::EncodeVarInt(Run.first, P);
+      P = edgelog::EncodeVarInt(Run.second, P);
+    }
+    P = edgelog::EncodeStreamVByte(Deltas.data(), Size, P);
+
+    // Modules must be defined before the chunk that uses them
+    writeModules();
+    WriteF(LogFile, Buf.data(), P - Buf.data());
+  }
+
+  void flush() override { FlushF(LogFile); }
+
+private:
+  explicit BinaryWriter(T File) : LogFile(File) {
+    std::uint8_t Header[sizeof(edgelog::kMagic) + edgelog::kMaxVarIntSize];
+    std::memcpy(Header, edgelog::kMagic, sizeof(edgelog::kMagic));
+    const std::uint8_t *End = edgelog::EncodeVarInt(
+        edgelog::kVersion, Header + sizeof(edgelog::kMagic));
+    WriteF(LogFile, Header, End - Header);
+  }
+
+  /// Encode the block `ID` as the index (+ 1) of its module (the upper 32
+  /// bits of the ID) and its local ID at `P`. No block and breaks are in
+  /// module 0.
+  std::uint8_t *encodeBlock(std::uint64_t ID, std::uint8_t *P) {
+    const std::uint32_t LocalID = static_cast<std::uint32_t>(ID);
+    const std::uint64_t Module = ID >> 32 ? getModule(ID >> 32) : 0;
+
+    P = edgelog::EncodeVarInt(Module, P);
+    return edgelog::EncodeVarInt(LocalID, P);
+  }
+
+  /// Return the module ID for the module with the given hash, queueing a
+  /// module record on first use
+  std::uint64_t getModule(std::uint64_t Hash) {
+    if (Hash == LastHash) {
+      return LastModule;
+    }
+
+    auto It = ModuleIDs.find(Hash);
+    if (It == ModuleIDs.end()) {
+      It = ModuleIDs.emplace(Hash, ModuleIDs.size() + 1).first;
+      LastIDs.push_back(0);
+
+      const std::size_t Start = Records.size();
+      Records.resize(Start + 1 + 2 * edgelog::kMaxVarIntSize);
+
+      std::uint8_t *P = Records.data() + Start;
+      *P++ = edgelog::RK_Module;
+      P = edgelog::EncodeVarInt(It->second, P);
+      P = edgelog::EncodeVarInt(Hash, P);
+      Records.resize(P - Records.data());
+    }
+
+    LastHash = Hash;
+    LastModule = It->second;
+    return LastModule;
+  }
+
+  /// Write the queued module records
+  void writeModules() {
+    if (!Records.empty()) {
+      WriteF(LogFile, Records.data(), Records.size());
+      Records.clear();
+    }
+  }
+
+  T LogFile;
+
+  /// Module IDs, keyed by module hash
+  std::unordered_map<std::uint64_t, std::uint64_t> ModuleIDs;
+  std::uint64_t LastHash = 0;
+  std::uint64_t LastModule = 0;
+
+  /// Module records not yet written
+  std::vector<std::uint8_t> Records;
+
+  /// Last local ID seen in each module in the current chunk
+  std::vector<std::uint32_t> LastIDs;
+
+  /// The runs of blocks in the same module (module ID and length) and the
+  /// local ID deltas of the current chunk
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> Runs;
+  std::vector<std::uint32_t> Deltas;
+
+  /// Encoding buffer for the current chunk
+  std::vector<std::uint8_t> Buf;
+};
+
+/// Writes the log from a fatal signal handler, so only uses async-signal-safe
+/// functions: output goes straight to a file descriptor through a static
+/// buffer, and modules (in binary logs) are tracked in a fixed-size table.
+/// The log is never compressed.
+class CrashWriter {
+public:
+  CrashWriter(int FD, bool Binary);
+  ~CrashWriter() { flush(); }
+
+  /// Write the sequence of blocks `Blocks` (executed after `Prev`)
+  void write(std::uint64_t Prev, const std::uint64_t *Blocks,
+             std::size_t Size);
+
+private:
+  void put(const void *Data, std::size_t Len);
+  void putVarInt(std::uint64_t V);
+  void putDecimal(std::uint64_t V);
+  void putBlock(std::uint64_t ID, bool Delta);
+  bool defineModule(std::uint64_t Hash);
+  std::uint64_t getModule(std::uint64_t Hash) const;
+  void flush();
+
+  const int FD;
+  const bool Binary;
+  std::size_t Len = 0;
+  std::size_t NumModules = 0;
+  bool Failed = false;
+
+  static std::uint8_t Buf[1 << 16];
+
+  /// Module hashes (+ 1, so that 0 is an empty slot), indexed by hash, and
+  /// the module ID assigned to each
+  static std::uint64_t ModuleHashes[2 * kMaxCrashModules];
+  static std::uint32_t ModuleIDs[2 * kMaxCrashModules];
+
+  /// Last local ID seen in each module in the current chunk
+  static std::uint32_t LastIDs[kMaxCrashModules + 1];
+};
+
+std::uint8_t CrashWriter::Buf[1 << 16];
+std::uint64_t CrashWriter::ModuleHashes[2 * kMaxCrashModules];
+std::uint32_t CrashWriter::ModuleIDs[2 * kMaxCrashModules];
+std::uint32_t CrashWriter::LastIDs[kMaxCrashModules + 1];
+
+CrashWriter::CrashWriter(int F, bool B) : FD(F), Binary(B) {
+  if (Binary) {
+    put(edgelog::kMagic, sizeof(edgelog::kMagic));
+    putVarInt(edgelog::kVersion);
+  } else {
+    put("prev_id,cur_id\n", 15);
+  }
+}
+
+void CrashWriter::flush() {
+  for (std::size_t Off = 0; Off < Len && !Failed;) {
+    const ssize_t N = ::write(FD, Buf + Off, Len - Off);
+    if (N > 0) {
+      Off += N;
+    } else if (N < 0 && errno != EINTR) {
+      Failed = true;
+    }
+  }
+  Len = 0;
+}
+
+void CrashWriter::put(const void *Data, std::size_t Size) {
+  if (Len + Size > sizeof(Buf)) {
+    flush();
+  }
+  memcpy(Buf + Len, Data, Size);
+  Len += Size;
+}
+
+void CrashWriter::putVarInt(std::uint64_t V) {
+  std::uint8_t Tmp[edgelog::kMaxVarIntSize];
+  put(Tmp, edgelog::EncodeVarInt(V, Tmp) - Tmp);
+}
+
+void CrashWriter::putDecimal(std::uint64_t V) {
+  char Tmp[20];
+  char *P = Tmp + sizeof(Tmp);
+  do {
+    *--P = '0' + V % 10;
+    V /= 10;
+  } while (V);
+  put(P, Tmp + sizeof(Tmp) - P);
+}
+
+/// Define the module with the given hash (writing its record) if it is not
+/// already. Returns false if the module table is full.
+bool CrashWriter::defineModule(std::uint64_t Hash) {
+  std::size_t I = Hash % (2 * kMaxCrashModules);
+  for (; ModuleHashes[I]; I = (I + 1) % (2 * kMaxCrashModules)) {
+    if (ModuleHashes[I] == Hash + 1) {
+      return true;
+    }
+  }
+  if (NumModules == kMaxCrashModules) {
+    return false;
+  }
+
+  ModuleHashes[I] = Hash + 1;
+  ModuleIDs[I] = ++NumModules;
+
+  const std::uint8_t Kind = edgelog::RK_Module;
+  put(&Kind, 1);
+  putVarInt(NumModules);
+  putVarInt(Hash);
+  return true;
+}
+
+std::uint64_t CrashWriter::getModule(std::uint64_t Hash) const {
+  std::size_t I = Hash % (2 * kMaxCrashModules);
+  while (ModuleHashes[I] != Hash + 1) {
+    I = (I + 1) % (2 * kMaxCrashModules);
+  }
+  return ModuleIDs[I];
+}
+
+/// Encode a block as in a `Chunk` record (see EdgeLogFormat.h)
+void CrashWriter::putBlock(std::uint64_t ID, bool Delta) {
+  const std::uint32_t LocalID = static_cast<std::uint32_t>(ID);
+  const std::uint64_t Module = ID >> 32 ? getModule(ID >> 32) : 0;
+
+  putVarInt(Module);
+  if (!Delta) {
+    putVarInt(LocalID);
+    return;
+  }
+
+  putVarInt(edgelog::ZigZagEncode(static_cast<std::int64_t>(LocalID) -
+                                  static_cast<std::int64_t>(LastIDs[Module])));
+  LastIDs[Module] = LocalID;
+}
+
+void CrashWriter::write(std::uint64_t Prev, const std::uint64_t *Blocks,
+                        std::size_t Size) {
+  if (!Binary) {
+    Prev = Prev == edgelog::kBreakID ? 0 : Prev;
+    for (std::size_t I = 0; I < Size; ++I) {
+      if (Blocks[I] == edgelog::kBreakID) {
+        Prev = 0;
+        continue;
+      }
+      putDecimal(Prev);
+      put(",", 1);
+      putDecimal(Blocks[I]);
+      put("\n", 1);
+      Prev = Blocks[I];
+    }
+    return;
+  }
+
+  // Modules must be defined before the chunk that uses them
+  if ((Prev >> 32) && !defineModule(Prev >> 32)) {
+    return;
+  }
+  for (std::size_t I = 0; I < Size; ++I) {
+    if ((Blocks[I] >> 32) && !defineModule(Blocks[I] >> 32)) {
+      return;
+    }
+  }
+
+  memset(LastIDs, 0, (NumModules + 1) * sizeof(LastIDs[0]));
+
+  const std::uint8_t Kind = edgelog::RK_Chunk;
+  put(&Kind, 1);
+  putVarInt(Size);
+  putBlock(Prev, /* Delta */ false);
+  for (std::size_t I = 0; I < Size; ++I) {
+    putBlock(Blocks[I], /* Delta */ true);
+  }
+}
+
+static int FileWrite(FILE *File, const void *Buf, unsigned Len) {
+  return fwrite(Buf, 1, Len, File);
+}
+
+/// Compresses output with gzip on a pool of worker threads. Output is split
+/// into fixed-size blocks, each compressed into a gzip member of its own (the
+/// log is the concatenation of these members, which gzip and zlib decompress
+/// as a single stream). Members are written in order, and the number of
+/// blocks in flight is bounded.
+///
+/// Compressed blocks are written straight to the file descriptor, so nothing
+/// is left buffered for a forked child to write again when it exits.
+class ParallelGZ {
+public:
+  static ParallelGZ *open(const char *LogPath, const char *Mode);
+
+  void write(const void *Data, std::size_t Len);
+  int printf(const char *Fmt, va_list Args);
+
+  /// Compress the remaining output, wait for all blocks to be written and
+  /// close the log. Returns 0 on success.
+  int close();
+
+private:
+  struct Block {
+    std::vector<std::uint8_t> In;
+    std::vector<std::uint8_t> Out;
+    bool Done = false;
+  };
+
+  ParallelGZ(int F, unsigned NumThreads);
+
+  void submit();
+  void run();
+  static void compress(Block &B);
+
+  const int FD;
+  std::unique_ptr<Block> Cur;
+  bool Failed = false;
+
+  std::mutex Mutex;
+  std::condition_variable WorkReady;
+  std::condition_variable BlockDone;
+
+  /// Blocks not yet written (in order), and the number of them not yet
+  /// picked up by a worker
+  std::deque<std::unique_ptr<Block>> Blocks;
+  std::size_t NumQueued = 0;
+  std::size_t MaxBlocks;
+  bool Writing = false;
+  bool Closing = false;
+
+  std::vector<std::thread> Workers;
+};
+
+ParallelGZ *ParallelGZ::open(const char *LogPath, const char *) {
+  const int F = ::open(LogPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (F < 0) {
+    return nullptr;
+  }
+
+  unsigned NumThreads = std::thread::hardware_concurrency();
+  if (const char *Threads = getenv(kGZipThreadsEnv)) {
+    NumThreads = strtoul(Threads, nullptr, 10);
+  }
+  return new ParallelGZ(F, std::max(1U, NumThreads));
+}
+
+ParallelGZ::ParallelGZ(int F, unsigned NumThreads)
+    : FD(F), Cur(new Block), MaxBlocks(2 * NumThreads) {
+  Cur->In.reserve(kGZipBlockSize);
+  for (unsigned I = 0; I < NumThreads; ++I) {
+    Workers.emplace_back(&ParallelGZ::run, this);
+  }
+}
+
+void ParallelGZ::write(const void *Data, std::size_t Len) {
+  const std::uint8_t *P = static_cast<const std::uint8_t *>(Data);
+  while (Len) {
+    const std::size_t N = std::min(Len, kGZipBlockSize - Cur->In.size());
+    Cur->In.insert(Cur->In.end(), P, P + N);
+    P += N;
+    Len -= N;
+
+    if (Cur->In.size() == kGZipBlockSize) {
+      submit();
+    }
+  }
+}
+
+int ParallelGZ::printf(const char *Fmt, va_list Args) {
+  char Tmp[256];
+  const int N = vsnprintf(Tmp, sizeof(Tmp), Fmt, Args);
+  if (N > 0) {
+    write(Tmp, std::min<std::size_t>(N, sizeof(Tmp) - 1));
+  }
+  return N;
+}
+
+/// Queue the current block for compression, waiting for a worker (or the
+/// output) to catch up if too many blocks are in flight
+void ParallelGZ::submit() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  BlockDone.wait(Lock, [this]() { return Blocks.size() < MaxBlocks; });
+
+  Blocks.push_back(std::move(Cur));
+  ++NumQueued;
+  WorkReady.notify_one();
+  Lock.unlock();
+
+  Cur.reset(new Block);
+  Cur->In.reserve(kGZipBlockSize);
+}
+
+void ParallelGZ::compress(Block &B) {
+  z_stream Z;
+  memset(&Z, 0, sizeof(Z));
+  // 16 + the maximum window size selects a gzip header and trailer
+  if (deflateInit2(&Z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return;
+  }
+
+  B.Out.resize(deflateBound(&Z, B.In.size()));
+  Z.next_in = B.In.data();
+  Z.avail_in = B.In.size();
+  Z.next_out = B.Out.data();
+  Z.avail_out = B.Out.size();
+  if (deflate(&Z, Z_FINISH) == Z_STREAM_END) {
+    B.Out.resize(Z.total_out);
+  } else {
+    B.Out.clear();
+  }
+  deflateEnd(&Z);
+}
+
+void ParallelGZ::run() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+
+  while (true) {
+    WorkReady.wait(Lock, [this]() { return NumQueued || Closing; });
+    if (!NumQueued) {
+      return;
+    }
+
+    Block &B = *Blocks[Blocks.size() - NumQueued--];
+    Lock.unlock();
+    compress(B);
+    Lock.lock();
+    B.Done = true;
+
+    // Write the completed blocks at the front of the queue (unless another
+    // worker already is)
+    while (!Writing && !Blocks.empty() && Blocks.front()->Done) {
+      std::unique_ptr<Block> Front = std::move(Blocks.front());
+      Blocks.pop_front();
+      Writing = true;
+      Lock.unlock();
+      if (Front->Out.empty()) {
+        Failed = true;
+      }
+      for (std::size_t Off = 0; Off < Front->Out.size() && !Failed;) {
+        const ssize_t N =
+            ::write(FD, Front->Out.data() + Off, Front->Out.size() - Off);
+        if (N > 0) {
+          Off += N;
+        } else if (N < 0 && errno != EINTR) {
+          Failed = true;
+        }
+      }
+      Front.reset();
+      Lock.lock();
+      Writing = false;
+    }
+    BlockDone.notify_all();
+  }
+}
+
+int ParallelGZ::close() {
+  if (!Cur->In.empty()) {
+    submit();
+  }
+
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    BlockDone.wait(Lock, [this]() { return Blocks.empty() && !Writing; });
+    Closing = true;
+  }
+  WorkReady.notify_all();
+  for (auto &Worker : Workers) {
+    Worker.join();
+  }
+
+  const bool Success = !::close(FD) && !Failed;
+  delete this;
+  return Success ? 0 : -1;
+}
+
+static ParallelGZ *PGZOpen(const char *LogPath, const char *Mode) {
+  return ParallelGZ::open(LogPath, Mode);
+}
+
+static int PGZPrintf(ParallelGZ *GZ, const char *Fmt, ...) {
+  va_list Args;
+  va_start(Args, Fmt);
+  const int N = GZ->printf(Fmt, Args);
+  va_end(Args);
+  return N;
+}
+
+static int PGZWrite(ParallelGZ *GZ, const void *Buf, unsigned Len) {
+  GZ->write(Buf, Len);
+  return Len;
+}
+
+/// Blocks still being compressed are only ever written by the parent, so need
+/// no flushing before a fork
+static int PGZFlush(ParallelGZ *) { return 0; }
+
+static int PGZClose(ParallelGZ *GZ) { return GZ->close(); }
+
+static EdgeWriter *OpenLog(const char *LogPath) {
+  const char *Format = getenv(kLogFormatEnv);
+  const bool GZip = getenv(kEnableGZipEnv);
+
+  if (Format && !strcmp(Format, "binary")) {
+    if (GZip) {
+      return BinaryWriter<ParallelGZ *, PGZOpen, PGZWrite, PGZFlush,
+                          PGZClose>::open(LogPath);
+    } else {
+      return BinaryWriter<FILE *, fopen, FileWrite, fflush, fclose>::open(
+          LogPath);
+    }
+  }
+
+  if (GZip) {
+    return CSVWriter<ParallelGZ *, PGZOpen, PGZPrintf, PGZFlush,
+                     PGZClose>::open(LogPath);
+  } else {
+    return CSVWriter<FILE *, fopen, fprintf, fflush, fclose>::open(LogPath);
+  }
+}
+
+/// Return the log path (`EDGE_LOG_PATH`, or empty if unset) with `%p` replaced
+/// by the process ID. Forked children always log to a path of their own: if
+/// the path does not contain `%p`, the child's PID is appended to it.
+static std::string GetLogPath() {
+  const char *Path = getenv(kEdgeLogEnv);
+  if (!Path) {
+    return std::string();
+  }
+
+  std::string Result;
+  bool HasPID = false;
+  for (const char *C = Path; *C; ++C) {
+    if (C[0] == '%' && C[1] == 'p') {
+      Result += std::to_string(getpid());
+      HasPID = true;
+      ++C;
+    } else {
+      Result += *C;
+    }
+  }
+
+  if (Forked && !HasPID) {
+    Result += '.' + std::to_string(getpid());
+  }
+  return Result;
+}
+
+/// Return the counts of all of a table's edges. The count of each uncounted
+/// edge is derived from a block where it is the only edge of unknown count, as
+/// a block is entered as many times as it is left. The spanning tree is
+/// rooted at the function's entry/exit (ID 0), so that block is never needed.
+static std::vector<std::uint64_t> GetEdgeCounts(const CounterTable &Table) {
+  const std::uint64_t *Edges = Table.Edges;
+  std::vector<std::uint64_t> Counts(Table.NumEdges);
+  std::vector<bool> Known(Table.NumEdges);
+  std::unordered_map<std::uint64_t, std::vector<std::size_t>> BlockEdges;
+  std::unordered_map<std::uint64_t, std::size_t> NumUnknown;
+
+  for (std::size_t I = 0; I < Table.NumEdges; ++I) {
+    const std::uint64_t Src = Edges[2 * I], Dst = Edges[2 * I + 1];
+    if (I < Table.NumCounters) {
+      Counts[I] = __atomic_load_n(&Table.Counters[I], __ATOMIC_RELAXED);
+      Known[I] = true;
+    } else {
+      ++NumUnknown[Src];
+      ++NumUnknown[Dst];
+    }
+    if (Src != Dst) {
+      BlockEdges[Src].push_back(I);
+      BlockEdges[Dst].push_back(I);
+    }
+  }
+
+  std::vector<std::uint64_t> Work;
+  for (const auto &KV : NumUnknown) {
+    if (KV.first && KV.second == 1) {
+      Work.push_back(KV.first);
+    }
+  }
+
+  while (!Work.empty()) {
+    const std::uint64_t BB = Work.back();
+    Work.pop_back();
+    if (NumUnknown[BB] != 1) {
+      continue;
+    }
+
+    // Inflow minus outflow over the block's known edges
+    std::int64_t Balance = 0;
+    std::size_t Unknown = 0;
+    for (std::size_t I : BlockEdges[BB]) {
+      if (!Known[I]) {
+        Unknown = I;
+      } else if (Edges[2 * I + 1] == BB) {
+        Balance += Counts[I];
+      } else {
+        Balance -= Counts[I];
+      }
+    }
+
+    // Threads that are still running when the counts are written may leave a
+    // block unbalanced
+    const std::int64_t Count =
+        Edges[2 * Unknown + 1] == BB ? -Balance : Balance;
+    Counts[Unknown] = Count > 0 ? Count : 0;
+    Known[Unknown] = true;
+
+    for (std::uint64_t Other : {Edges[2 * Unknown], Edges[2 * Unknown + 1]}) {
+      if (--NumUnknown[Other] == 1 && Other) {
+        Work.push_back(Other);
+      }
+    }
+  }
+
+  return Counts;
+}
+
+/// Write the edge counts of all registered modules as CSV rows
 template <typename T, T OpenF(const char *, const char *),
           int PrintF(T, const char *, ...), int CloseF(T)>
-static void WriteLog(const char *LogPath) {
-  Dl_info Info;
-
+static void WriteCounts(const char *LogPath) {
   T LogFile = OpenF(LogPath, "w");
   if (!LogFile) {
     return;
   }
 
-  PrintF(LogFile, "shared_object,base_addr,prev_addr,cur_addr\n");
-  for (const auto &Edge : *Edges) {
-    const std::uintptr_t Prev = Edge.first;
-    const std::uintptr_t Cur = Edge.second;
+  PrintF(LogFile, "prev_id,cur_id,count\n");
+  for (const auto &Table : *CounterTables) {
+    const std::vector<std::uint64_t> Counts = GetEdgeCounts(Table);
+    for (std::size_t I = 0; I < Table.NumEdges; ++I) {
+      // Function exits are not edges
+      if (Counts[I] && Table.Edges[2 * I + 1]) {
+        PrintF(LogFile, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+               Table.Edges[2 * I], Table.Edges[2 * I + 1], Counts[I]);
+      }
+    }
+  }
+
+  CloseF(LogFile);
+}
 
-    dladdr(reinterpret_cast<void *>(Cur), &Info);
-    const std::uintptr_t Base =
-        reinterpret_cast<std::uintptr_t>(Info.dli_fbase);
-    const char *SharedObj = Info.dli_fname;
+static pthread_key_t ThreadExitKey;
+static pthread_once_t ThreadExitOnce = PTHREAD_ONCE_INIT;
 
-    PrintF(LogFile, "%s,%zu,%zu,%zu\n", SharedObj, Base, Prev, Cur);
+/// Publish the final size of an exiting thread's chunk. Edges logged by the
+/// thread after this point (e.g., by later thread-local destructors) are lost.
+static void ThreadExit(void *Arg) {
+  ThreadBuffer *Buf = static_cast<ThreadBuffer *>(Arg);
+
+  // Wait for any other thread reading the cursor, and stop others from
+  // reading it once the thread's thread-locals are freed
+  int Expected = TS_Running;
+  while (!Buf->State.compare_exchange_weak(Expected, TS_Exited,
+                                           std::memory_order_acquire)) {
+    Expected = TS_Running;
+    std::this_thread::yield();
   }
+  PublishChunkSize(Buf, __edge_log_thread.Cursor);
 
-  CloseF(LogFile);
+  if (Log && Buf->Extent) {
+    Buf->Mapped.store(nullptr, std::memory_order_release);
+    Log->retire(Buf->Extent);
+  }
+}
+
+/// Register the calling thread's buffer, starting with the chunk `Head` (null
+/// when logging to a mapped log)
+static ThreadBuffer *RegisterThread(EdgeChunk *Head) {
+  pthread_once(&ThreadExitOnce,
+               []() { pthread_key_create(&ThreadExitKey, ThreadExit); });
+
+  ThreadBuffer *Buf = new ThreadBuffer();
+  Buf->Head = Head;
+  Buf->Current.store(Head, std::memory_order_relaxed);
+  Buf->Cursor = &__edge_log_thread.Cursor;
+  Buf->Next = ThreadBuffers.load(std::memory_order_relaxed);
+  while (!ThreadBuffers.compare_exchange_weak(Buf->Next, Buf,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+  }
+
+  pthread_setspecific(ThreadExitKey, Buf);
+  CurBuffer = Buf;
+  return Buf;
+}
+
+/// Start a new raw chunk in the mapped log for the calling thread (whose
+/// current chunk, if any, is full)
+static void NewMappedChunk() {
+  ThreadState &Thread = __edge_log_thread;
+  ThreadBuffer *Buf = CurBuffer ? CurBuffer : RegisterThread(nullptr);
+  edgelog::RawChunkHeader *Full = Buf->Mapped.load(std::memory_order_relaxed);
+  std::uint64_t Prev = Buf->Prev;
+
+  if (EdgeChunk *Chunk = Buf->Current.load(std::memory_order_relaxed)) {
+    // The thread started logging before the log was opened (e.g., from
+    // another module's constructor)
+    Chunk->Size.store(kChunkEntries, std::memory_order_release);
+    Prev = Chunk->Blocks[kChunkEntries - 1];
+    Log->append(Buf->Head);
+    Buf->Current.store(nullptr, std::memory_order_release);
+    Buf->Head = nullptr;
+  } else if (Full) {
+    __atomic_store_n(&Full->Size, kChunkEntries, __ATOMIC_RELEASE);
+    Prev = reinterpret_cast<std::uint64_t *>(Full + 1)[kChunkEntries - 1];
+  }
+
+  if (!Buf->Extent ||
+      Buf->ExtentPos + kRawChunkSize > Buf->Extent + Log->getExtentSize()) {
+    Buf->Extent = Buf->ExtentPos = Log->mapExtent(Buf->Extent);
+  }
+
+  if (!Buf->Extent) {
+    if (!Buf->Discard) {
+      Buf->Discard = new std::uint64_t[kChunkEntries];
+    }
+    Buf->Mapped.store(nullptr, std::memory_order_release);
+    Buf->Prev = 0;
+    Thread.Cursor = Buf->Discard;
+    Thread.End = Thread.ChunkEnd = Buf->Discard + kChunkEntries;
+    return;
+  }
+
+  auto *Chunk = reinterpret_cast<edgelog::RawChunkHeader *>(Buf->ExtentPos);
+  Buf->ExtentPos += kRawChunkSize;
+
+  Chunk->Kind = edgelog::RK_RawChunk;
+  Chunk->Prev = Prev;
+  Chunk->Capacity = kChunkEntries;
+  Chunk->Size = edgelog::kUnknownSize;
+  Buf->Mapped.store(Chunk, std::memory_order_release);
+
+  Thread.Cursor = reinterpret_cast<std::uint64_t *>(Chunk + 1);
+  Thread.End = Thread.ChunkEnd = Thread.Cursor + kChunkEntries;
+}
+
+/// Start a new chunk for the calling thread (whose current chunk, if any, is
+/// full), registering the thread's buffer on first use.
+__attribute__((noinline)) static void NewChunk() {
+  if (Log) {
+    NewMappedChunk();
+    return;
+  }
+
+  ThreadBuffer *Buf = CurBuffer;
+  EdgeChunk *Full =
+      Buf ? Buf->Current.load(std::memory_order_relaxed) : nullptr;
+  EdgeChunk *Chunk = nullptr;
+  std::uint64_t Prev = 0;
+
+  if (Full) {
+    Full->Size.store(kChunkEntries, std::memory_order_release);
+    Prev = Full->Blocks[kChunkEntries - 1];
+
+    if (UniqueEdges) {
+      // Only distinct edges are kept, so the chunk can be reused
+      UniqueEdges->insert(Full);
+      ResetChunk(Full, Prev);
+      Chunk = Full;
+    } else if (Stream) {
+      Chunk = Stream->handOff(Buf, Prev);
+    }
+  }
+
+  if (!Chunk) {
+    Chunk = new EdgeChunk;
+    ResetChunk(Chunk, Prev);
+
+    if (Full) {
+      Full->Next.store(Chunk, std::memory_order_release);
+      Buf->Current.store(Chunk, std::memory_order_release);
+    } else {
+      if (Stream) {
+        Stream->addChunk();
+      }
+      RegisterThread(Chunk);
+    }
+  }
+
+  ThreadState &Thread = __edge_log_thread;
+  Thread.Cursor = Chunk->Blocks;
+  Thread.End = Thread.ChunkEnd = Chunk->Blocks + kChunkEntries;
+}
+
+/// Write the log after a fatal signal. When streaming, the log is already
+/// written up to the chunks still held in memory, which are lost. Edge counts
+/// are not written, as the counts of uncounted edges cannot be derived
+/// without allocating.
+static void FatalSignal(int Sig) {
+  const bool First = !LogWritten.exchange(true);
+  if (First && Log) {
+    // The mapped log only lacks the size of each thread's last chunk
+    for (ThreadBuffer *Buf = ThreadBuffers.load(std::memory_order_acquire);
+         Buf; Buf = Buf->Next) {
+      SyncChunk(Buf);
+    }
+  } else if (First && !Stream && !CounterTables && CrashLogPath[0]) {
+    const int SavedErrno = errno;
+    const int FD = open(CrashLogPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (FD >= 0) {
+      {
+        CrashWriter Writer(FD, CrashLogBinary);
+
+        // Other threads may still be running, so their buffers are left alone
+        for (ThreadBuffer *Buf = ThreadBuffers.load(std::memory_order_acquire);
+             Buf; Buf = Buf->Next) {
+          SyncChunk(Buf);
+          for (const EdgeChunk *Chunk = Buf->Head; Chunk;
+               Chunk = Chunk->Next.load(std::memory_order_acquire)) {
+            Writer.write(Chunk->Prev, Chunk->Blocks,
+                         Chunk->Size.load(std::memory_order_acquire));
+          }
+        }
+
+        if (UniqueEdges) {
+          UniqueEdges->forEach([&](std::uint64_t Prev, std::uint64_t Cur) {
+            Writer.write(Prev, &Cur, 1);
+          });
+        }
+      }
+      close(FD);
+    }
+    errno = SavedErrno;
+  }
+
+  // The handler was reset on entry, so this terminates the process as the
+  // original signal would have
+  raise(Sig);
+}
+
+static void SetCrashLogPath() {
+  const std::string LogPath = GetLogPath();
+  if (LogPath.size() >= sizeof(CrashLogPath)) {
+    CrashLogPath[0] = '\0';
+  } else {
+    strcpy(CrashLogPath, LogPath.c_str());
+  }
+}
+
+/// Write the log when the process is killed by a fatal signal, unless the
+/// program handles the signal itself
+static void InstallSignalHandlers() {
+  SetCrashLogPath();
+
+  const char *Format = getenv(kLogFormatEnv);
+  CrashLogBinary = Format && !strcmp(Format, "binary");
+
+  for (int Sig : kFatalSignals) {
+    struct sigaction Old;
+    if (sigaction(Sig, nullptr, &Old) || Old.sa_handler != SIG_DFL) {
+      continue;
+    }
+
+    struct sigaction New;
+    memset(&New, 0, sizeof(New));
+    New.sa_handler = FatalSignal;
+    New.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&New.sa_mask);
+    sigaction(Sig, &New, nullptr);
+  }
+}
+
+/// Start a new generation (ending the current one, if any).
+/// Async-signal-safe.
+static void NewGeneration() {
+  std::uint32_t Gen = ++LastGeneration;
+  if (!Gen) {
+    Gen = ++LastGeneration;
+  }
+  __atomic_store_n(&__edge_log_generation, Gen, __ATOMIC_RELAXED);
+}
+
+/// End the current generation, without starting another. Async-signal-safe.
+static void EndGeneration() {
+  __atomic_store_n(&__edge_log_generation, 0, __ATOMIC_RELAXED);
+}
+
+/// Start logging (if it is stopped), in a new generation. Async-signal-safe.
+static void StartLogging() {
+  Stopped.store(false, std::memory_order_relaxed);
+  if (__atomic_load_n(&__edge_log_generation, __ATOMIC_RELAXED)) {
+    return;
+  }
+  NewGeneration();
+}
+
+/// Stop logging, until the program starts it again. Async-signal-safe.
+static void StopLogging() {
+  Stopped.store(true, std::memory_order_relaxed);
+  EndGeneration();
+}
+
+static void ToggleLogging(int) {
+  if (__atomic_load_n(&__edge_log_generation, __ATOMIC_RELAXED)) {
+    StopLogging();
+  } else {
+    StartLogging();
+  }
+}
+
+/// Toggle logging on each delivery of the signal given by
+/// `EDGE_LOG_TOGGLE_SIGNAL` (if any)
+static void InstallToggleHandler() {
+  const char *Sig = getenv(kToggleSignalEnv);
+  if (!Sig) {
+    return;
+  }
+
+  struct sigaction New;
+  memset(&New, 0, sizeof(New));
+  New.sa_handler = ToggleLogging;
+  New.sa_flags = SA_RESTART;
+  sigemptyset(&New.sa_mask);
+  sigaction(atoi(Sig), &New, nullptr);
+}
+
+/// Parse `EDGE_LOG_SAMPLE` (`<period>ms` or `1/<requests>`) and
+/// `EDGE_LOG_SAMPLE_BURST`
+static void ParseSampling() {
+  const char *Sample = getenv(kSampleEnv);
+  if (!Sample) {
+    return;
+  }
+
+  char *End;
+  if (!strncmp(Sample, "1/", 2)) {
+    SampleRequests = strtoul(Sample + 2, &End, 10);
+  } else {
+    SamplePeriod = strtoul(Sample, &End, 10);
+    if (strcmp(End, "ms")) {
+      SamplePeriod = 0;
+    }
+  }
+  if (!SamplePeriod && !SampleRequests) {
+    return;
+  }
+
+  Sampling = true;
+  SampleBurst = kDefaultSampleBurst;
+  if (const char *Burst = getenv(kSampleBurstEnv)) {
+    // A burst of 0 blocks is unlimited, and only ends with the next burst
+    SampleBurst = strtoul(Burst, nullptr, 10);
+    if (!SampleBurst) {
+      SampleBurst = SIZE_MAX;
+    }
+  }
+}
+
+/// Start a burst every `SamplePeriod` ms (when sampling by time), unless
+/// logging is stopped by the program
+static void StartSampler() {
+  if (!SamplePeriod) {
+    return;
+  }
+
+  std::thread([] {
+    for (;;) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(SamplePeriod));
+      if (!Stopped.load(std::memory_order_relaxed)) {
+        NewGeneration();
+      }
+    }
+  }).detach();
+}
+
+/// Start streaming the log to `LogPath`
+static void StartStream(const char *LogPath) {
+  EdgeWriter *Writer = OpenLog(LogPath);
+  if (!Writer) {
+    return;
+  }
+
+  std::size_t BufferSize = kDefaultBufferSize;
+  if (const char *Size = getenv(kBufferSizeEnv)) {
+    BufferSize = strtoul(Size, nullptr, 10);
+  }
+
+  // Always allow one chunk to be written while another is being filled
+  const std::size_t MaxChunks =
+      std::max<std::size_t>(2, (BufferSize << 20) / sizeof(EdgeChunk));
+  Stream = new EdgeStream(Writer, MaxChunks);
+}
+
+static void PrepareFork() {
+  CounterTablesMutex.lock();
+  SampledThreadsMutex.lock();
+  if (Stream) {
+    Stream->lockForFork();
+  }
+}
+
+static void AfterForkParent() {
+  if (Stream) {
+    Stream->unlockAfterFork();
+  }
+  SampledThreadsMutex.unlock();
+  CounterTablesMutex.unlock();
+}
+
+/// Give the child a log of its own, containing only the edges it executes.
+/// Only the forking thread survives, so the other threads' buffers (and the
+/// chunks already logged by the forking thread) are abandoned: they are left
+/// untouched, so that they are never copied.
+static void AfterForkChild() {
+  Forked = true;
+  SampledThreadsMutex.unlock();
+  CounterTablesMutex.unlock();
+  SetCrashLogPath();
+
+  if (CounterTables) {
+    for (const auto &Table : *CounterTables) {
+      memset(const_cast<std::uint64_t *>(Table.Counters), 0,
+             Table.NumCounters * sizeof(std::uint64_t));
+    }
+  }
+
+  ThreadBuffer *Buf = CurBuffer;
+  ThreadState &Thread = __edge_log_thread;
+  if (Buf) {
+    Buf->Next = nullptr;
+  }
+
+  // Only the forking thread's request can still be sampled
+  SampledThreads = Thread.InSampledRequest;
+  if (SampleRequests && !SampledThreads) {
+    EndGeneration();
+  }
+  ThreadBuffers.store(Buf, std::memory_order_relaxed);
+
+  if (Log) {
+    // The parent's extents are left mapped (but unused), and the thread
+    // continues in a new raw chunk in the child's own log
+    Log = MappedLog::open(GetLogPath().c_str());
+    if (Buf && !Buf->Current.load(std::memory_order_relaxed)) {
+      if (edgelog::RawChunkHeader *Raw =
+              Buf->Mapped.load(std::memory_order_relaxed)) {
+        const auto *Blocks = reinterpret_cast<std::uint64_t *>(Raw + 1);
+        Buf->Prev = Thread.Cursor > Blocks ? Thread.Cursor[-1] : Raw->Prev;
+      }
+      Buf->Mapped.store(nullptr, std::memory_order_relaxed);
+      Buf->Extent = Buf->ExtentPos = nullptr;
+      Thread.Cursor = Thread.End = Thread.ChunkEnd = nullptr;
+      return;
+    }
+  }
+
+  if (Buf) {
+    // Continue from the last block logged before the fork
+    EdgeChunk *Chunk = Buf->Current.load(std::memory_order_relaxed);
+    const std::uint64_t Prev =
+        Thread.Cursor > Chunk->Blocks ? Thread.Cursor[-1] : Chunk->Prev;
+    ResetChunk(Chunk, Prev);
+    Buf->Head = Chunk;
+    Thread.Cursor = Chunk->Blocks;
+  }
+
+  if (UniqueEdges) {
+    UniqueEdges = new EdgeSet;
+    memset(RecentEdges, 0, sizeof(RecentEdges));
+  }
+
+  // The sampler and writer threads did not survive the fork
+  StartSampler();
+  if (Stream) {
+    Stream = nullptr;
+    StartStream(GetLogPath().c_str());
+    if (Stream && Buf) {
+      Stream->addChunk();
+    }
+  }
 }
 
 __attribute__((constructor)) static void Initialize() {
-  Edges = new EdgeVector;
+  const std::string LogPath = GetLogPath();
+  if (LogPath.empty()) {
+    return;
+  }
+
+  pthread_atfork(PrepareFork, AfterForkParent, AfterForkChild);
+  InstallSignalHandlers();
+  InstallToggleHandler();
+  if (getenv(kLogStoppedEnv)) {
+    StopLogging();
+  }
+
+  // When sampling by time, the first burst starts straight away. When
+  // sampling by request, it waits for the first sampled request.
+  ParseSampling();
+  if (SampleRequests) {
+    EndGeneration();
+  }
+  StartSampler();
+
+  // Modules instrumented in counts mode register their counters first (see
+  // `__edge_log_register_counters`). Their counts are written at exit, so
+  // there is no trace to log.
+  if (CounterTables) {
+    return;
+  }
+
+  const char *Mode = getenv(kLogModeEnv);
+  if (Mode && !strcmp(Mode, "unique")) {
+    UniqueEdges = new EdgeSet;
+    return;
+  }
+
+  // Uncompressed binary logs are written in place, so there is nothing to
+  // stream
+  const char *Format = getenv(kLogFormatEnv);
+  if (Format && !strcmp(Format, "binary") && !getenv(kEnableGZipEnv)) {
+    Log = MappedLog::open(LogPath.c_str());
+    if (Log) {
+      return;
+    }
+  }
+
+  if (getenv(kEnableStreamEnv)) {
+    StartStream(LogPath.c_str());
+  }
 }
 
 __attribute__((destructor)) static void AtExit() {
-  const char *LogPath = getenv(kEdgeLogEnv);
-  if (!LogPath) {
-    goto Cleanup;
+  if (LogWritten.exchange(true)) {
+    return;
   }
 
-  if (getenv(kEnableGZipEnv)) {
-    WriteLog<gzFile, gzopen, gzprintf, gzclose>(LogPath);
-  } else {
-    WriteLog<FILE *, fopen, fprintf, fclose>(LogPath);
+  ThreadBuffer *Bufs = ThreadBuffers.load(std::memory_order_acquire);
+
+  if (Stream) {
+    Stream->close(Bufs);
+  }
+
+  const std::string LogPath = GetLogPath();
+  if (LogPath.empty()) {
+    return;
+  }
+
+  // Edge counts replace the trace (mixing modules instrumented in trace and
+  // counts mode is not supported)
+  if (CounterTables) {
+    if (getenv(kEnableGZipEnv)) {
+      WriteCounts<ParallelGZ *, PGZOpen, PGZPrintf, PGZClose>(LogPath.c_str());
+    } else {
+      WriteCounts<FILE *, fopen, fprintf, fclose>(LogPath.c_str());
+    }
+    return;
+  }
+
+  if (Stream) {
+    return;
+  }
+
+  if (Log) {
+    // Only the size of each thread's last chunk is left to write, unless it
+    // has not logged since the log was opened
+    for (ThreadBuffer *Buf = Bufs; Buf; Buf = Buf->Next) {
+      SyncChunk(Buf);
+      if (Buf->Head) {
+        Log->append(Buf->Head);
+      }
+    }
+    return;
+  }
+
+  EdgeWriter *Writer = OpenLog(LogPath.c_str());
+  if (!Writer) {
+    return;
+  }
+
+  // Other threads may still be running, so their buffers are left alone
+  for (ThreadBuffer *Buf = Bufs; Buf; Buf = Buf->Next) {
+    SyncChunk(Buf);
+    if (UniqueEdges) {
+      UniqueEdges->insert(Buf->Head);
+    } else {
+      Writer->writeChain(Buf->Head);
+    }
+  }
+
+  if (UniqueEdges) {
+    UniqueEdges->write(Writer);
+  }
+
+  delete Writer;
+}
+
+/// Move the calling thread's `End` up to the end of its chunk or burst,
+/// whichever comes first
+static void ExtendBurst(ThreadState &Thread) {
+  if (!Sampling) {
+    return;
   }
 
-Cleanup:
-  delete Edges;
+  const std::size_t N =
+      std::min<std::size_t>(Thread.ChunkEnd - Thread.Cursor, Thread.BurstLeft);
+  Thread.End = Thread.Cursor + N;
+  Thread.BurstLeft -= N;
 }
 
-extern "C" void __edge_log() {
-  const void *Ret = __builtin_return_address(0);
-  const std::uintptr_t CurBB = reinterpret_cast<std::uintptr_t>(Ret);
+/// Start a burst for the calling thread in generation `Gen`, separated by a
+/// break from the blocks it logged before (if any)
+static void StartBurst(ThreadState &Thread, std::uint32_t Gen) {
+  Thread.End = Thread.ChunkEnd;
+  if (Thread.Generation) {
+    if (Thread.Cursor == Thread.End) {
+      NewChunk();
+    }
+    *Thread.Cursor++ = edgelog::kBreakID;
+  }
+  Thread.Generation = Gen;
+  Thread.BurstLeft = SampleBurst;
+  ExtendBurst(Thread);
+}
+
+/// Make room for the calling thread to log a block in generation `Gen`
+/// (starting a new chunk if its current one is full). Returns false if the
+/// block is to be dropped, as the thread's burst is over (or, when sampling by
+/// request, its request is not sampled).
+__attribute__((noinline)) static bool PrepareLog(std::uint32_t Gen) {
+  ThreadState &Thread = __edge_log_thread;
+  if (SampleRequests && !Thread.InSampledRequest) {
+    return false;
+  }
+
+  if (Thread.Generation != Gen) {
+    // Logging was stopped (or a new burst started) since the thread last
+    // logged
+    StartBurst(Thread, Gen);
+  }
+
+  if (Thread.Cursor == Thread.End) {
+    if (Thread.Cursor == Thread.ChunkEnd && Thread.BurstLeft) {
+      NewChunk();
+      ExtendBurst(Thread);
+    }
+    if (Thread.Cursor == Thread.End) {
+      // End the burst for every thread (unless the next one has already
+      // started), so that the program runs at nearly full speed until the
+      // next burst. Bursts of sampled requests belong to a single thread, so
+      // they only end with the thread's request.
+      if (!SampleRequests) {
+        __atomic_compare_exchange_n(&__edge_log_generation, &Gen, 0, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+extern "C" void __edge_log(std::uint64_t CurBB) {
+  const std::uint32_t Gen =
+      __atomic_load_n(&__edge_log_generation, __ATOMIC_RELAXED);
+  if (__builtin_expect(!Gen, 0)) {
+    return;
+  }
+
+  ThreadState &Thread = __edge_log_thread;
+  if (__builtin_expect(Thread.Generation != Gen || Thread.Cursor == Thread.End,
+                       0)) {
+    if (!PrepareLog(Gen)) {
+      return;
+    }
+  }
+
+  *Thread.Cursor++ = CurBB;
+}
 
-  Edges->push_back({PrevBB, CurBB});
-  PrevBB = CurBB;
+extern "C" void __edge_log_start() { StartLogging(); }
+
+extern "C" void __edge_log_stop() { StopLogging(); }
+
+extern "C" void __edge_log_request() {
+  if (!SampleRequests) {
+    return;
+  }
+
+  ThreadState &Thread = __edge_log_thread;
+  const bool Sample =
+      !(Requests.fetch_add(1, std::memory_order_relaxed) % SampleRequests);
+  if (!Sample && !Thread.InSampledRequest) {
+    return;
+  }
+
+  // Logging is started while any thread is in a sampled request (unless the
+  // program stopped it), and stopped once none are
+  std::lock_guard<std::mutex> Lock(SampledThreadsMutex);
+  SampledThreads += Sample;
+  SampledThreads -= Thread.InSampledRequest;
+  Thread.InSampledRequest = Sample;
+
+  std::uint32_t Gen = __atomic_load_n(&__edge_log_generation, __ATOMIC_RELAXED);
+  if (!SampledThreads) {
+    EndGeneration();
+  } else if (!Gen && !Stopped.load(std::memory_order_relaxed)) {
+    NewGeneration();
+    Gen = __atomic_load_n(&__edge_log_generation, __ATOMIC_RELAXED);
+  }
+
+  if (!Sample) {
+    // Send the thread's next block to `PrepareLog`, which drops it
+    Thread.End = Thread.Cursor;
+  } else if (Gen) {
+    StartBurst(Thread, Gen);
+  } else {
+    // The burst starts when the program starts logging again
+    Thread.End = Thread.Cursor;
+  }
+}
+
+extern "C" void __edge_log_register_counters(std::uint64_t *Counters,
+                                             const std::uint64_t *Edges,
+                                             std::uint64_t NumCounters,
+                                             std::uint64_t NumEdges) {
+  std::lock_guard<std::mutex> Lock(CounterTablesMutex);
+  if (!CounterTables) {
+    CounterTables = new std::vector<CounterTable>;
+  }
+  CounterTables->push_back({Counters, Edges,
+                            static_cast<std::size_t>(NumCounters),
+                            static_cast<std::size_t>(NumEdges)});
 }
@@ -0,0 +1,63 @@
+//===-- CrashTest.cpp - Log a known sequence of blocks, then crash -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Logs `N` blocks on the main thread and `N` blocks on a second thread
+/// (which is still running), then aborts. Each thread cycles through
+/// `kCycle` blocks of a module of its own, so the log holds `2 * N` edges,
+/// `2 * (kCycle + 1)` of them distinct (once `N > kCycle`).
+///
+//===----------------------------------------------------------------------===//
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+extern "C" void __edge_log(std::uint64_t CurBB);
+
+static const std::uint64_t kCycle = 1000;
+
+static void LogBlocks(std::uint64_t Module, unsigned long N) {
+  for (unsigned long I = 0; I < N; ++I) {
+    __edge_log(Module << 32 | (I % kCycle + 1));
+  }
+}
+
+int main(int argc, char **argv) {
+  const unsigned long N = argc > 1 ? strtoul(argv[1], nullptr, 10) : 0;
+
+  std::mutex Mutex;
+  std::condition_variable Logged;
+  bool Done = false;
+
+  std::thread([&] {
+    LogBlocks(0x2468ace1, N);
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Done = true;
+    }
+    Logged.notify_one();
+
+    // Keep running until the process is killed
+    for (;;) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+  }).detach();
+
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Logged.wait(Lock, [&] { return Done; });
+  }
+
+  LogBlocks(0x13579bdf, N);
+  abort();
+}
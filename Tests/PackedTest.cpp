@@ -0,0 +1,67 @@
+//===-- PackedTest.cpp - Log chunks of awkward sizes and deltas ----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Logs a known sequence of blocks on each of a series of threads, one after
+/// another, and prints the edges they log in CSV format. The `I`th thread logs
+/// `I` blocks, so that the thread's chunk (written when the program exits)
+/// holds `I` blocks. Blocks alternate between two modules in runs of varying
+/// length, and their local IDs are chosen so that the (zigzag-encoded) deltas
+/// between them take from one to four bytes. Every third thread also stops
+/// and restarts logging halfway, which adds a break to its chunk.
+///
+//===----------------------------------------------------------------------===//
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+extern "C" void __edge_log(std::uint64_t CurBB);
+extern "C" void __edge_log_start();
+extern "C" void __edge_log_stop();
+
+static const std::uint64_t kModules[] = {0x13579bdf, 0x2468ace1};
+
+/// Local IDs whose deltas (in either order) are 1, 2, 3 and 4 bytes long
+static const std::uint32_t kLocalIDs[] = {
+    1,        2,          0x7f,       0x80,       0x3fff,     0x4000,
+    0x1fffff, 0x200000,   0xfffffff,  0x10000000, 0xffffffff, 3,
+    0x8000,   0x7fffffff, 0x80000000, 0x12345,    5,          0xabcdef};
+
+static const unsigned kNumLocalIDs = sizeof(kLocalIDs) / sizeof(kLocalIDs[0]);
+
+static void LogBlocks(unsigned T, unsigned N) {
+  std::uint64_t Prev = 0;
+  for (unsigned I = 0; I < N; ++I) {
+    if (T % 3 == 0 && I == N / 2) {
+      __edge_log_stop();
+      __edge_log_start();
+      Prev = 0;
+    }
+
+    const std::uint64_t Module = kModules[(I + T) / (T % 5 + 1) % 2];
+    const std::uint64_t Cur =
+        Module << 32 | kLocalIDs[(I * 7 + T) % kNumLocalIDs];
+    __edge_log(Cur);
+    printf("%" PRIu64 ",%" PRIu64 "\n", Prev, Cur);
+    Prev = Cur;
+  }
+}
+
+int main(int argc, char **argv) {
+  const unsigned NumThreads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 0;
+
+  printf("prev_id,cur_id\n");
+  for (unsigned T = 1; T <= NumThreads; ++T) {
+    std::thread(LogBlocks, T, T).join();
+  }
+  return 0;
+}
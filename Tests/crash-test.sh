@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Check that the log is written when an instrumented program is killed by a
+# fatal signal, in each output mode.
+#
+# Usage: crash-test.sh CRASH_TEST EDGE_LOG_TO_CSV
+
+set -u
+
+CRASH_TEST=$1
+TO_CSV=$2
+
+# Blocks logged by each of the two threads (spanning several chunks)
+N=200000
+CYCLE=1000
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+FAILED=0
+
+# check NAME EXPECTED_ROWS UNIQ [ENV...]: run the crash test with the given
+# environment, and check the number of edges in its log (only counting
+# distinct edges if UNIQ is set)
+check() {
+  local name=$1 expected=$2 uniq=$3
+  shift 3
+
+  local log="$DIR/$name.log"
+  env "$@" EDGE_LOG_PATH="$log" "$CRASH_TEST" $N 2>/dev/null
+  if [ ! -s "$log" ]; then
+    echo "FAIL: $name: no log written"
+    FAILED=1
+    return
+  fi
+
+  local csv="$log"
+  if [ "$(head -c 7 "$log")" = "EDGELOG" ]; then
+    csv="$DIR/$name.csv"
+    if ! "$TO_CSV" "$log" "$csv"; then
+      echo "FAIL: $name: cannot decode log"
+      FAILED=1
+      return
+    fi
+  fi
+
+  local rows
+  if [ -n "$uniq" ]; then
+    rows=$(tail -n +2 "$csv" | sort -u | wc -l)
+  else
+    rows=$(($(wc -l < "$csv") - 1))
+  fi
+  if [ "$rows" -ne "$expected" ]; then
+    echo "FAIL: $name: $rows edges logged (expected $expected)"
+    FAILED=1
+  else
+    echo "PASS: $name"
+  fi
+}
+
+# The edges still held in each thread's chunk are written as they are in
+# unique mode, so some edges may appear more than once
+check csv $((2 * N)) ""
+check csv-gzip $((2 * N)) "" EDGE_LOG_GZIP=1
+check unique $((2 * (CYCLE + 1))) 1 EDGE_LOG_MODE=unique
+check binary $((2 * N)) "" EDGE_LOG_FORMAT=binary
+check binary-gzip $((2 * N)) "" EDGE_LOG_FORMAT=binary EDGE_LOG_GZIP=1
+
+exit $FAILED
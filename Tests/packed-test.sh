@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# Check that packed chunks of every size (with deltas of every length, and
+# breaks) decode to the edges that were logged, with each given converter
+# (e.g., with and without the SSSE3 decoder).
+#
+# Usage: packed-test.sh PACKED_TEST EDGE_LOG_TO_CSV...
+
+set -u
+
+PACKED_TEST=$1
+shift
+
+# Threads (and chunk sizes) logged
+THREADS=70
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+FAILED=0
+
+# Uncompressed binary logs hold raw chunks, so compress the log
+if ! EDGE_LOG_FORMAT=binary EDGE_LOG_GZIP=1 EDGE_LOG_PATH="$DIR/log" \
+    "$PACKED_TEST" $THREADS > "$DIR/expected.csv"; then
+  echo "FAIL: packed test failed"
+  exit 1
+fi
+sort "$DIR/expected.csv" > "$DIR/expected.sorted"
+
+for TO_CSV in "$@"; do
+  name=$(basename "$TO_CSV")
+  if ! "$TO_CSV" "$DIR/log" "$DIR/$name.csv"; then
+    echo "FAIL: $name: cannot decode log"
+    FAILED=1
+    continue
+  fi
+
+  # Threads' chunks are not necessarily written in the order they were logged
+  if ! sort "$DIR/$name.csv" | cmp -s - "$DIR/expected.sorted"; then
+    echo "FAIL: $name: edges differ from those logged"
+    FAILED=1
+  else
+    echo "PASS: $name"
+  fi
+done
+
+exit $FAILED
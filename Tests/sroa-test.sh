@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Check that instrumentation leaves the entry block's allocas static, so that
+# SROA still promotes them to registers.
+#
+# Usage: sroa-test.sh OPT PLUGIN INPUT
+
+set -u
+
+OPT=$1
+PLUGIN=$2
+INPUT=$3
+
+FAILED=0
+
+# check NAME PIPELINE [OPTIONS...]: instrument INPUT with the given pipeline
+# and options, and check that no alloca is left
+check() {
+  local name=$1 pipeline=$2
+  shift 2
+
+  local out
+  if ! out=$("$OPT" -load "$PLUGIN" -load-pass-plugin "$PLUGIN" "$@" \
+                 -passes="$pipeline" -S "$INPUT" -o -); then
+    echo "FAIL: $name: opt failed"
+    FAILED=1
+  elif grep -q alloca <<< "$out"; then
+    echo "FAIL: $name: allocas not promoted"
+    FAILED=1
+  else
+    echo "PASS: $name"
+  fi
+}
+
+check calls 'edge-log,sroa'
+check inline 'edge-log,sroa' -edge-log-inline
+check toggle 'edge-log,sroa' -edge-log-toggle
+check inline-toggle 'edge-log,sroa' -edge-log-inline -edge-log-toggle
+
+# With -edge-log-early, the pass runs at the start of the pipeline, ahead of
+# SROA
+check early 'edge-log,sroa' -edge-log-early -edge-log-inline
+check early-O1 'default<O1>' -edge-log-early -edge-log-inline -edge-log-toggle
+
+exit $FAILED
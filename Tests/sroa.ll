@@ -0,0 +1,32 @@
+; Locals of the entry block (which instrumentation splits) and of a loop
+
+define i32 @local(i32 %a) {
+entry:
+  %x = alloca i32
+  store i32 %a, i32* %x
+  %v = load i32, i32* %x
+  ret i32 %v
+}
+
+define i32 @sum(i32 %n) {
+entry:
+  %s = alloca i32
+  %i = alloca i32
+  store i32 0, i32* %s
+  store i32 0, i32* %i
+  br label %loop
+
+loop:
+  %iv = load i32, i32* %i
+  %sv = load i32, i32* %s
+  %sn = add i32 %sv, %iv
+  store i32 %sn, i32* %s
+  %in = add i32 %iv, 1
+  store i32 %in, i32* %i
+  %c = icmp slt i32 %in, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  %r = load i32, i32* %s
+  ret i32 %r
+}
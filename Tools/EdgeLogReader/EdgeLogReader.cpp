@@ -0,0 +1,528 @@
+//===-- EdgeLogReader.cpp - Binary edge log reader ----------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <endian.h>
+
+// The SSSE3 decoder can be left out (with `EDGE_LOG_NO_SSSE3`), so that the
+// scalar one can be tested on any machine
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(EDGE_LOG_NO_SSSE3)
+#define EDGE_LOG_SSSE3
+#include <tmmintrin.h>
+#endif
+
+#include "EdgeLogFormat.h"
+#include "EdgeLogReader.h"
+
+using namespace edgelog;
+
+static const std::size_t kReadSize = 1 << 20;
+
+/// Largest raw or packed chunk accepted (in blocks)
+static const std::uint64_t kMaxChunkSize = 1 << 24;
+
+/// The number of data bytes in a group of four stream-vbyte values, and the
+/// shuffle that moves their bytes into place, indexed by control byte
+struct StreamVByteTables {
+  StreamVByteTables() {
+    for (unsigned C = 0; C < 256; ++C) {
+      unsigned Pos = 0;
+      for (unsigned I = 0; I < 4; ++I) {
+        const unsigned Len = ((C >> (2 * I)) & 3) + 1;
+        for (unsigned J = 0; J < 4; ++J) {
+          Shuffles[C][4 * I + J] = J < Len ? Pos + J : 0x80;
+        }
+        Pos += Len;
+      }
+      Lengths[C] = Pos;
+    }
+  }
+
+  std::uint8_t Lengths[256];
+  std::uint8_t Shuffles[256][16];
+};
+
+static const StreamVByteTables SVBTables;
+
+/// Decode `N` values stream-vbyte-encoded at `Control` and `Data` (see
+/// EncodeStreamVByte) into `Out`, a group of four at a time. Reads up to 16
+/// bytes past the data, and writes up to three values past `N`.
+static void DecodeStreamVByteScalar(const std::uint8_t *Control,
+                                    const std::uint8_t *Data, std::size_t N,
+                                    std::uint32_t *Out) {
+  for (std::size_t I = 0; I < N; I += 4) {
+    const std::uint8_t C = *Control++;
+    for (unsigned J = 0; J < 4; ++J) {
+      const unsigned Len = ((C >> (2 * J)) & 3) + 1;
+      std::uint32_t V = 0;
+      for (unsigned K = 0; K < Len; ++K) {
+        V |= static_cast<std::uint32_t>(Data[K]) << (8 * K);
+      }
+      Out[I + J] = V;
+      Data += Len;
+    }
+  }
+}
+
+#ifdef EDGE_LOG_SSSE3
+__attribute__((target("ssse3"))) static void
+DecodeStreamVByteSSSE3(const std::uint8_t *Control, const std::uint8_t *Data,
+                       std::size_t N, std::uint32_t *Out) {
+  for (std::size_t I = 0; I < N; I += 4) {
+    const std::uint8_t C = *Control++;
+    const __m128i In =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(Data));
+    const __m128i Shuffle = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(SVBTables.Shuffles[C]));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(Out + I),
+                     _mm_shuffle_epi8(In, Shuffle));
+    Data += SVBTables.Lengths[C];
+  }
+}
+#endif
+
+static void DecodeStreamVByte(const std::uint8_t *Control,
+                              const std::uint8_t *Data, std::size_t N,
+                              std::uint32_t *Out) {
+#ifdef EDGE_LOG_SSSE3
+  static const bool HasSSSE3 = __builtin_cpu_supports("ssse3");
+  if (HasSSSE3) {
+    DecodeStreamVByteSSSE3(Control, Data, N, Out);
+    return;
+  }
+#endif
+  DecodeStreamVByteScalar(Control, Data, N, Out);
+}
+
+std::unique_ptr<EdgeLogReader> EdgeLogReader::open(const std::string &Path,
+                                                   std::string &Error) {
+  gzFile F = gzopen(Path.c_str(), "rb");
+  if (!F) {
+    Error = "unable to open " + Path;
+    return nullptr;
+  }
+
+  std::unique_ptr<EdgeLogReader> Reader(new EdgeLogReader(F));
+  if (!Reader->readHeader()) {
+    Error = Path + ": " + Reader->getError();
+    return nullptr;
+  }
+
+  return Reader;
+}
+
+EdgeLogReader::EdgeLogReader(gzFile F) : File(F), Buf(kReadSize) {
+  Modules.emplace_back(new Module{0, 0});
+  Prev = {Modules[0].get(), 0};
+}
+
+EdgeLogReader::~EdgeLogReader() { gzclose(File); }
+
+/// Load a single block map, recording each pruned block against the block
+/// that implies it
+static bool LoadBlockMap(const std::string &Path,
+                         ImpliedBlockMap &ImpliedBlocks) {
+  FILE *F = fopen(Path.c_str(), "r");
+  if (!F) {
+    return false;
+  }
+
+  // Source file names may contain commas, so only rely on the first (`id`)
+  // and last (`implied_by`) columns
+  char *Line = nullptr;
+  std::size_t Size = 0;
+  bool Header = true;
+  while (getline(&Line, &Size, F) != -1) {
+    if (Header) {
+      Header = false;
+      continue;
+    }
+    const char *ImpliedBy = strrchr(Line, ',');
+    if (!ImpliedBy || ImpliedBy[1] == '\n' || ImpliedBy[1] == '\0') {
+      continue;
+    }
+    const std::uint64_t ID = strtoull(Line, nullptr, 10);
+    ImpliedBlocks[strtoull(ImpliedBy + 1, nullptr, 10)] =
+        static_cast<std::uint32_t>(ID);
+  }
+
+  free(Line);
+  fclose(F);
+  return true;
+}
+
+bool edgelog::LoadBlockMaps(const std::string &Dir,
+                            ImpliedBlockMap &ImpliedBlocks,
+                            std::string &Error) {
+  DIR *D = opendir(Dir.c_str());
+  if (!D) {
+    Error = "unable to open " + Dir;
+    return false;
+  }
+
+  bool Success = true;
+  while (const struct dirent *Ent = readdir(D)) {
+    const std::string Name = Ent->d_name;
+    if (Name.size() < 4 || Name.compare(Name.size() - 4, 4, ".csv")) {
+      continue;
+    }
+    if (!LoadBlockMap(Dir + "/" + Name, ImpliedBlocks)) {
+      Error = "unable to read " + Dir + "/" + Name;
+      Success = false;
+      break;
+    }
+  }
+
+  closedir(D);
+  return Success;
+}
+
+bool EdgeLogReader::loadBlockMaps(const std::string &Dir, std::string &Error) {
+  return LoadBlockMaps(Dir, ImpliedBlocks, Error);
+}
+
+bool EdgeLogReader::fail(const char *Msg) {
+  Error = Msg;
+  return false;
+}
+
+bool EdgeLogReader::readByte(std::uint8_t &Byte) {
+  if (Pos == End) {
+    const int N = gzread(File, Buf.data(), Buf.size());
+    if (N < 0) {
+      return fail("read error");
+    } else if (N == 0) {
+      return false;
+    }
+    Pos = 0;
+    End = N;
+  }
+
+  Byte = Buf[Pos++];
+  return true;
+}
+
+bool EdgeLogReader::readBytes(void *Data, std::size_t Len) {
+  std::uint8_t *Out = static_cast<std::uint8_t *>(Data);
+  while (Len) {
+    if (Pos == End) {
+      std::uint8_t Byte;
+      if (!readByte(Byte)) {
+        return false;
+      }
+      *Out++ = Byte;
+      --Len;
+      continue;
+    }
+
+    const std::size_t N = std::min(Len, End - Pos);
+    std::memcpy(Out, Buf.data() + Pos, N);
+    Pos += N;
+    Out += N;
+    Len -= N;
+  }
+  return true;
+}
+
+bool EdgeLogReader::readUInt64(std::uint64_t &V) {
+  std::uint8_t Bytes[8];
+  if (!readBytes(Bytes, sizeof(Bytes))) {
+    return fail("truncated chunk");
+  }
+
+  V = 0;
+  for (unsigned I = 0; I < sizeof(Bytes); ++I) {
+    V |= static_cast<std::uint64_t>(Bytes[I]) << (8 * I);
+  }
+  return true;
+}
+
+bool EdgeLogReader::readVarInt(std::uint64_t &V) {
+  std::uint8_t Byte;
+
+  V = 0;
+  for (unsigned Shift = 0; Shift < 64; Shift += 7) {
+    if (!readByte(Byte)) {
+      return fail("truncated varint");
+    }
+    V |= static_cast<std::uint64_t>(Byte & 0x7f) << Shift;
+    if (!(Byte & 0x80)) {
+      return true;
+    }
+  }
+
+  return fail("malformed varint");
+}
+
+bool EdgeLogReader::readHeader() {
+  char Magic[sizeof(kMagic)];
+  std::uint64_t Version;
+
+  for (auto &C : Magic) {
+    std::uint8_t Byte;
+    if (!readByte(Byte)) {
+      return fail("not an edge log");
+    }
+    C = static_cast<char>(Byte);
+  }
+  if (std::memcmp(Magic, kMagic, sizeof(kMagic))) {
+    return fail("not an edge log");
+  }
+
+  if (!readVarInt(Version)) {
+    return false;
+  }
+  if (Version < kMinVersion || Version > kVersion) {
+    return fail("unsupported edge log version");
+  }
+
+  return true;
+}
+
+bool EdgeLogReader::readModule() {
+  std::uint64_t ID, Hash;
+
+  if (!readVarInt(ID) || !readVarInt(Hash)) {
+    return false;
+  }
+  if (ID == 0 || Hash > UINT32_MAX) {
+    return fail("invalid module");
+  }
+
+  if (ID >= Modules.size()) {
+    Modules.resize(ID + 1);
+  }
+  Modules[ID].reset(new Module{ID, static_cast<std::uint32_t>(Hash)});
+  ModulesByHash[Modules[ID]->Hash] = Modules[ID].get();
+
+  return true;
+}
+
+Block EdgeLogReader::getBlock(std::uint64_t ID) {
+  // No block, or a break
+  if (!(ID >> 32)) {
+    return {Modules[0].get(), 0};
+  }
+
+  // Raw chunks do not refer to module records, so define modules on first use
+  const std::uint32_t Hash = static_cast<std::uint32_t>(ID >> 32);
+  if (!LastModule || LastModule->Hash != Hash) {
+    Module *&Mod = ModulesByHash[Hash];
+    if (!Mod) {
+      Modules.emplace_back(new Module{Modules.size(), Hash});
+      Mod = Modules.back().get();
+    }
+    LastModule = Mod;
+  }
+
+  return {LastModule, static_cast<std::uint32_t>(ID)};
+}
+
+bool EdgeLogReader::readRawChunk() {
+  std::uint8_t Padding[sizeof(RawChunkHeader::Padding)];
+  std::uint64_t PrevID, Capacity, Size;
+
+  if (!readBytes(Padding, sizeof(Padding)) || !readUInt64(PrevID) ||
+      !readUInt64(Capacity) || !readUInt64(Size)) {
+    return fail("truncated chunk");
+  }
+  if (Capacity > kMaxChunkSize ||
+      (Size != kUnknownSize && Size > Capacity)) {
+    return fail("invalid chunk");
+  }
+
+  RawBlocks.resize(Capacity);
+  if (!readBytes(RawBlocks.data(), Capacity * sizeof(std::uint64_t))) {
+    return fail("truncated chunk");
+  }
+  for (auto &ID : RawBlocks) {
+    ID = le64toh(ID);
+  }
+
+  // The chunk was not completed (e.g., the process was killed)
+  if (Size == kUnknownSize) {
+    Size = std::find(RawBlocks.begin(), RawBlocks.end(), 0) - RawBlocks.begin();
+  }
+
+  ChunkBlocks.resize(Size);
+  for (std::size_t I = 0; I < Size; ++I) {
+    ChunkBlocks[I] = getBlock(RawBlocks[I]);
+  }
+
+  Prev = getBlock(PrevID);
+  Remaining = Size;
+  ChunkPos = 0;
+  Decoded = true;
+  return true;
+}
+
+bool EdgeLogReader::readPackedChunk() {
+  std::uint64_t Size, NumRuns;
+
+  if (!readVarInt(Size) || !readBlock(Prev, /* Delta */ false) ||
+      !readVarInt(NumRuns)) {
+    return false;
+  }
+  if (Size > kMaxChunkSize || NumRuns > Size) {
+    return fail("invalid chunk");
+  }
+
+  // Expand the runs of modules into the chunk's blocks (the local IDs are
+  // filled in below)
+  ChunkBlocks.resize(Size);
+  std::size_t Pos = 0;
+  for (std::uint64_t I = 0; I < NumRuns; ++I) {
+    std::uint64_t ID, Len;
+    if (!readVarInt(ID) || !readVarInt(Len)) {
+      return false;
+    }
+    if (ID >= Modules.size() || !Modules[ID]) {
+      return fail("undefined module ID");
+    }
+    if (Len > Size - Pos) {
+      return fail("invalid chunk");
+    }
+    std::fill_n(ChunkBlocks.begin() + Pos, Len, Block{Modules[ID].get(), 0});
+    Pos += Len;
+  }
+  if (Pos != Size) {
+    return fail("invalid chunk");
+  }
+
+  // The decoder reads past the end of the data (and writes past the end of
+  // the deltas), so leave room for it
+  const std::size_t ControlSize = (Size + 3) / 4;
+  Packed.resize(ControlSize);
+  if (!readBytes(Packed.data(), ControlSize)) {
+    return fail("truncated chunk");
+  }
+  // Unused values in the last group have no data, but are counted as one
+  // byte each by its control byte
+  std::size_t DataSize = 0;
+  for (std::size_t I = 0; I < ControlSize; ++I) {
+    DataSize += SVBTables.Lengths[Packed[I]];
+  }
+  DataSize -= 4 * ControlSize - Size;
+  Packed.resize(ControlSize + DataSize + 16);
+  if (!readBytes(Packed.data() + ControlSize, DataSize)) {
+    return fail("truncated chunk");
+  }
+
+  Deltas.resize(Size + 3);
+  DecodeStreamVByte(Packed.data(), Packed.data() + ControlSize, Size,
+                    Deltas.data());
+
+  LastIDs.assign(Modules.size(), 0);
+  for (std::size_t I = 0; I < Size; ++I) {
+    Block &B = ChunkBlocks[I];
+    std::uint32_t &Last = LastIDs[B.Mod->ID];
+    Last += static_cast<std::uint32_t>(ZigZagDecode32(Deltas[I]));
+    B.LocalID = Last;
+  }
+
+  Remaining = Size;
+  ChunkPos = 0;
+  Decoded = true;
+  return true;
+}
+
+bool EdgeLogReader::readBlock(Block &B, bool Delta) {
+  std::uint64_t ID, LocalID;
+
+  if (!readVarInt(ID) || !readVarInt(LocalID)) {
+    return false;
+  }
+  if (ID >= Modules.size() || !Modules[ID]) {
+    return fail("undefined module ID");
+  }
+
+  if (Delta) {
+    LocalID = LastIDs[ID] + ZigZagDecode(LocalID);
+    LastIDs[ID] = static_cast<std::uint32_t>(LocalID);
+  }
+
+  // Blocks in module 0 (no block, or a break) are all "no block"
+  B = {Modules[ID].get(), ID ? static_cast<std::uint32_t>(LocalID) : 0};
+  return true;
+}
+
+bool EdgeLogReader::readRecord() {
+  std::uint8_t Kind;
+
+  if (!readByte(Kind)) {
+    return false;
+  }
+
+  switch (Kind) {
+  case RK_Padding:
+    return true;
+  case RK_Module:
+    return readModule();
+  case RK_Chunk:
+    LastIDs.assign(Modules.size(), 0);
+    Decoded = false;
+    return readVarInt(Remaining) && readBlock(Prev, /* Delta */ false);
+  case RK_RawChunk:
+    return readRawChunk();
+  case RK_PackedChunk:
+    return readPackedChunk();
+  default:
+    return fail("unknown record kind");
+  }
+}
+
+bool EdgeLogReader::next(Edge &E) {
+  while (Pending.empty()) {
+    while (Remaining == 0) {
+      if (!readRecord()) {
+        return false;
+      }
+    }
+
+    Block Cur;
+    if (Decoded) {
+      Cur = ChunkBlocks[ChunkPos++];
+    } else if (!readBlock(Cur, /* Delta */ true)) {
+      return false;
+    }
+    --Remaining;
+
+    // A break: the next block has no predecessor
+    if (!Cur.Mod->ID) {
+      Prev = {Modules[0].get(), 0};
+      continue;
+    }
+
+    if (ImpliedBlocks.empty()) {
+      E = {Prev, Cur};
+      Prev = Cur;
+      return true;
+    }
+
+    // Restore the unlogged blocks executed before `Cur` (they belong to the
+    // same module)
+    Pending.push_back(Cur);
+    for (auto It = ImpliedBlocks.find(Cur.getID()); It != ImpliedBlocks.end();
+         It = ImpliedBlocks.find(Pending.back().getID())) {
+      Pending.push_back({Cur.Mod, It->second});
+    }
+  }
+
+  E.Prev = Prev;
+  E.Cur = Pending.back();
+  Pending.pop_back();
+
+  Prev = E.Cur;
+  return true;
+}
@@ -0,0 +1,144 @@
+//===-- EdgeLogReader.h - Binary edge log reader ------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Decodes binary edge logs (see EdgeLogFormat.h) written by the edge log
+/// runtime. Logs may optionally be gzip-compressed.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef EDGE_LOG_READER_H
+#define EDGE_LOG_READER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <zlib.h>
+
+namespace edgelog {
+
+/// An instrumented module that executed blocks belong to
+struct Module {
+  /// Module ID (local to the log)
+  std::uint64_t ID;
+  /// Module hash (the upper 32 bits of its blocks' IDs)
+  std::uint32_t Hash;
+};
+
+/// An executed basic block
+struct Block {
+  const Module *Mod;
+  /// The lower 32 bits of the block's ID
+  std::uint32_t LocalID;
+
+  /// Return the block's ID (as assigned by the EdgeLog pass)
+  std::uint64_t getID() const {
+    return static_cast<std::uint64_t>(Mod->Hash) << 32 | LocalID;
+  }
+};
+
+/// An executed edge in the control-flow graph
+struct Edge {
+  Block Prev;
+  Block Cur;
+};
+
+/// Maps a block's ID to the local ID of the (unlogged) block that it implies
+/// was executed immediately before it (in the same module)
+using ImpliedBlockMap = std::unordered_map<std::uint64_t, std::uint32_t>;
+
+/// Load the block maps written by the EdgeLog pass to `Dir` into
+/// `ImpliedBlocks`. Returns false (and sets `Error`) on failure.
+bool LoadBlockMaps(const std::string &Dir, ImpliedBlockMap &ImpliedBlocks,
+                   std::string &Error);
+
+class EdgeLogReader {
+public:
+  /// Open the log at `Path`. Returns null (and sets `Error`) on failure.
+  static std::unique_ptr<EdgeLogReader> open(const std::string &Path,
+                                             std::string &Error);
+
+  ~EdgeLogReader();
+
+  /// Load the block maps written by the EdgeLog pass to `Dir`, so that blocks
+  /// that were not logged (see `-edge-log-prune`) are restored. Returns false
+  /// (and sets `Error`) on failure.
+  bool loadBlockMaps(const std::string &Dir, std::string &Error);
+
+  /// Read the next edge into `E`. Returns false at the end of the log, or if
+  /// the log is malformed (in which case `getError` is non-empty).
+  bool next(Edge &E);
+
+  const std::string &getError() const { return Error; }
+
+private:
+  explicit EdgeLogReader(gzFile F);
+
+  bool readHeader();
+  bool readRecord();
+  bool readModule();
+  bool readRawChunk();
+  bool readPackedChunk();
+  bool readBlock(Block &B, bool Delta);
+  bool readByte(std::uint8_t &Byte);
+  bool readBytes(void *Data, std::size_t Len);
+  bool readUInt64(std::uint64_t &V);
+  bool readVarInt(std::uint64_t &V);
+  Block getBlock(std::uint64_t ID);
+  bool fail(const char *Msg);
+
+  gzFile File;
+  std::vector<std::uint8_t> Buf;
+  std::size_t Pos = 0;
+  std::size_t End = 0;
+
+  /// Modules, indexed by ID. Module 0 is "no block".
+  std::vector<std::unique_ptr<Module>> Modules;
+
+  /// Modules, keyed by hash
+  std::unordered_map<std::uint32_t, Module *> ModulesByHash;
+
+  /// The module of the last block looked up by ID
+  Module *LastModule = nullptr;
+
+  /// Last local ID seen in each module in the current chunk
+  std::vector<std::uint32_t> LastIDs;
+
+  /// Number of blocks left to read in the current chunk
+  std::uint64_t Remaining = 0;
+
+  /// The blocks in the current chunk, if it is decoded in one go (i.e., it is
+  /// a raw or packed chunk), and the position of the next one
+  std::vector<Block> ChunkBlocks;
+  std::size_t ChunkPos = 0;
+  bool Decoded = false;
+
+  /// Decoding buffers
+  std::vector<std::uint64_t> RawBlocks;
+  std::vector<std::uint8_t> Packed;
+  std::vector<std::uint32_t> Deltas;
+
+  /// The previously-read block
+  Block Prev;
+
+  /// Blocks to return before reading the next block from the log (in reverse
+  /// order): the last-read block, preceded by the blocks it implies
+  std::vector<Block> Pending;
+
+  ImpliedBlockMap ImpliedBlocks;
+
+  std::string Error;
+};
+
+} // namespace edgelog
+
+#endif // EDGE_LOG_READER_H
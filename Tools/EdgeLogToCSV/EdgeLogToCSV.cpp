@@ -0,0 +1,96 @@
+//===-- EdgeLogToCSV.cpp - Convert a binary edge log to CSV -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Converts a binary edge log to the CSV format written by the runtime, so that
+/// existing consumers (e.g., summarize_edges.py) continue to work. If the
+/// program was instrumented with `-edge-log-prune`, the directory containing
+/// its block maps must be given (with `-m`) to restore the unlogged blocks.
+///
+/// With `-s`, each block ID is split into its module hash (in hex, as in the
+/// names of block map files) and its local ID, for joining with block maps.
+///
+//===----------------------------------------------------------------------===//
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "EdgeLogReader.h"
+
+using namespace edgelog;
+
+int main(int argc, char *argv[]) {
+  const char *MapDir = nullptr;
+  bool Split = false;
+  int Arg = 1;
+  while (argc > Arg + 1 && argv[Arg][0] == '-') {
+    if (!strcmp(argv[Arg], "-m")) {
+      MapDir = argv[Arg + 1];
+      Arg += 2;
+    } else if (!strcmp(argv[Arg], "-s")) {
+      Split = true;
+      ++Arg;
+    } else {
+      break;
+    }
+  }
+
+  if (argc - Arg < 1 || argc - Arg > 2) {
+    fprintf(stderr, "usage: %s [-m MAP_DIR] [-s] LOG [CSV]\n", argv[0]);
+    return 1;
+  }
+  const char *LogPath = argv[Arg];
+  const char *CSVPath = argc - Arg == 2 ? argv[Arg + 1] : nullptr;
+
+  std::string Error;
+  auto Reader = EdgeLogReader::open(LogPath, Error);
+  if (!Reader) {
+    fprintf(stderr, "error: %s\n", Error.c_str());
+    return 1;
+  }
+
+  if (MapDir && !Reader->loadBlockMaps(MapDir, Error)) {
+    fprintf(stderr, "error: %s\n", Error.c_str());
+    return 1;
+  }
+
+  FILE *Out = CSVPath ? fopen(CSVPath, "w") : stdout;
+  if (!Out) {
+    fprintf(stderr, "error: unable to open %s\n", CSVPath);
+    return 1;
+  }
+
+  Edge E;
+  if (Split) {
+    fprintf(Out, "prev_module,prev_local_id,cur_module,cur_local_id\n");
+    while (Reader->next(E)) {
+      fprintf(Out, "%08" PRIx32 ",%" PRIu32 ",%08" PRIx32 ",%" PRIu32 "\n",
+              E.Prev.Mod->Hash, E.Prev.LocalID, E.Cur.Mod->Hash,
+              E.Cur.LocalID);
+    }
+  } else {
+    fprintf(Out, "prev_id,cur_id\n");
+    while (Reader->next(E)) {
+      fprintf(Out, "%" PRIu64 ",%" PRIu64 "\n", E.Prev.getID(),
+              E.Cur.getID());
+    }
+  }
+
+  if (Out != stdout) {
+    fclose(Out);
+  }
+
+  if (!Reader->getError().empty()) {
+    fprintf(stderr, "error: %s: %s\n", LogPath, Reader->getError().c_str());
+    return 1;
+  }
+
+  return 0;
+}
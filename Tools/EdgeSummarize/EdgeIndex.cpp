@@ -0,0 +1,379 @@
+//===-- EdgeIndex.cpp - Persistent index of executed edges --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <queue>
+
+#include "EdgeIndex.h"
+
+using namespace edgelog;
+
+static const char kSegmentMagic[8] = {'E', 'D', 'G', 'E', 'I', 'D', 'X', '\0'};
+static const std::uint64_t kSegmentVersion = 1;
+
+/// Name suffix of segment files (which are named after their sequence number,
+/// in hex)
+static const char kSegmentSuffix[] = ".seg";
+
+/// Name prefix of segments being written
+static const char kTempPrefix[] = ".tmp-";
+
+/// Number of bloom filter bits per edge, and number of bits set per edge
+/// (for a false positive rate of about 1%)
+static const std::uint64_t kBloomBitsPerKey = 10;
+static const unsigned kBloomHashes = 7;
+
+/// Size of the bloom filter's blocks (in bits). An edge's bits all fall in
+/// one block, so that a lookup touches a single cache line.
+static const std::uint64_t kBloomBlockBits = 512;
+
+/// Return the size tier of a segment with `NumKeys` edges (the floor of its
+/// base-2 logarithm)
+static unsigned SizeTier(std::uint64_t NumKeys) {
+  return 63 - __builtin_clzll(NumKeys | 1);
+}
+
+/// The header of a segment file, followed by the bloom filter (`BloomBits`
+/// bits, in 64-bit words) and the sorted edges. Integers are in native byte
+/// order. The header is padded to a cache line, so that the bloom filter's
+/// blocks are aligned.
+struct SegmentHeader {
+  char Magic[8];
+  std::uint64_t Version;
+  std::uint64_t NumKeys;
+  std::uint64_t BloomBits;
+  std::uint64_t Reserved[4];
+};
+
+static std::uint64_t Mix(std::uint64_t H) {
+  H ^= H >> 33;
+  H *= 0xff51afd7ed558ccdULL;
+  H ^= H >> 33;
+  H *= 0xc4ceb9fe1a85ec53ULL;
+  return H ^ (H >> 33);
+}
+
+static std::uint64_t HashKey(const EdgeIndex::Key &K) {
+  return Mix(K.first ^ Mix(K.second));
+}
+
+/// Call `Fn(Bit)` for each bloom filter bit of the edge with hash `H`
+template <typename FnT>
+static void ForEachBloomBit(std::uint64_t H, std::uint64_t BloomBits,
+                            FnT Fn) {
+  const std::uint64_t Block = H % (BloomBits / kBloomBlockBits);
+  std::uint64_t Bits = Mix(H);
+  for (unsigned I = 0; I < kBloomHashes; ++I, Bits >>= 9) {
+    Fn(Block * kBloomBlockBits + Bits % kBloomBlockBits);
+  }
+}
+
+std::unique_ptr<EdgeIndex> EdgeIndex::open(const std::string &Dir,
+                                           std::string &Error) {
+  if (mkdir(Dir.c_str(), 0755) && errno != EEXIST) {
+    Error = "unable to create " + Dir;
+    return nullptr;
+  }
+
+  const std::string LockPath = Dir + "/lock";
+  const int Lock = ::open(LockPath.c_str(), O_RDWR | O_CREAT, 0644);
+  if (Lock < 0 || flock(Lock, LOCK_EX)) {
+    if (Lock >= 0) {
+      close(Lock);
+    }
+    Error = "unable to lock " + LockPath;
+    return nullptr;
+  }
+
+  std::unique_ptr<EdgeIndex> Index(new EdgeIndex(Dir, Lock));
+  if (!Index->load(Error)) {
+    return nullptr;
+  }
+  return Index;
+}
+
+EdgeIndex::~EdgeIndex() {
+  for (const auto &Seg : Segments) {
+    munmap(const_cast<void *>(Seg.Data), Seg.Size);
+  }
+  close(LockFD);
+}
+
+bool EdgeIndex::load(std::string &Error) {
+  DIR *D = opendir(Dir.c_str());
+  if (!D) {
+    Error = "unable to open " + Dir;
+    return false;
+  }
+
+  std::vector<std::pair<std::uint64_t, std::string>> Names;
+  while (const struct dirent *Ent = readdir(D)) {
+    const std::string Name = Ent->d_name;
+
+    // Segments left incomplete by an interrupted update (the index is locked,
+    // so no other update is in progress)
+    if (!Name.compare(0, sizeof(kTempPrefix) - 1, kTempPrefix)) {
+      unlink((Dir + "/" + Name).c_str());
+      continue;
+    }
+
+    const std::size_t SuffixLen = sizeof(kSegmentSuffix) - 1;
+    if (Name.size() <= SuffixLen ||
+        Name.compare(Name.size() - SuffixLen, SuffixLen, kSegmentSuffix)) {
+      continue;
+    }
+    char *End;
+    const std::uint64_t Seq = strtoull(Name.c_str(), &End, 16);
+    if (End == Name.c_str() + Name.size() - SuffixLen) {
+      Names.emplace_back(Seq, Name);
+    }
+  }
+  closedir(D);
+
+  std::sort(Names.begin(), Names.end());
+  for (const auto &Name : Names) {
+    if (!mapSegment(Name.second, Name.first, Error)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool EdgeIndex::mapSegment(const std::string &Name, std::uint64_t Seq,
+                           std::string &Error) {
+  const std::string Path = Dir + "/" + Name;
+  const int FD = ::open(Path.c_str(), O_RDONLY);
+  struct stat Stat;
+  if (FD < 0 || fstat(FD, &Stat)) {
+    if (FD >= 0) {
+      close(FD);
+    }
+    Error = "unable to open " + Path;
+    return false;
+  }
+
+  const std::size_t Size = Stat.st_size;
+  void *Data = Size >= sizeof(SegmentHeader)
+                   ? mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, FD, 0)
+                   : MAP_FAILED;
+  close(FD);
+  if (Data == MAP_FAILED) {
+    Error = "invalid segment " + Path;
+    return false;
+  }
+
+  const auto *Header = static_cast<const SegmentHeader *>(Data);
+  const std::uint64_t BloomSize = Header->BloomBits / 8;
+  if (memcmp(Header->Magic, kSegmentMagic, sizeof(kSegmentMagic)) ||
+      Header->Version != kSegmentVersion || !Header->BloomBits ||
+      Header->BloomBits % kBloomBlockBits ||
+      Size != sizeof(SegmentHeader) + BloomSize +
+                  Header->NumKeys * sizeof(Key)) {
+    munmap(Data, Size);
+    Error = "invalid segment " + Path;
+    return false;
+  }
+
+  const auto *Bloom = reinterpret_cast<const std::uint64_t *>(Header + 1);
+  Segments.push_back({Path, Seq, Data, Size, Bloom, Header->BloomBits,
+                      reinterpret_cast<const Key *>(Bloom + BloomSize / 8),
+                      Header->NumKeys});
+  NextSeq = std::max(NextSeq, Seq + 1);
+  return true;
+}
+
+bool EdgeIndex::Segment::find(const Key &K, std::uint64_t Hash,
+                              std::uint64_t &Pos) const {
+  bool Maybe = true;
+  ForEachBloomBit(Hash, BloomBits, [&](std::uint64_t Bit) {
+    Maybe &= (Bloom[Bit / 64] >> (Bit % 64)) & 1;
+  });
+  if (!Maybe) {
+    return false;
+  }
+
+  // Gallop forward from `Pos`, then binary search the last step
+  std::uint64_t Lo = Pos, Hi = Pos;
+  for (std::uint64_t Step = 1; Hi < NumKeys && Keys[Hi] < K; Step *= 2) {
+    Lo = Hi + 1;
+    Hi += Step;
+  }
+  Hi = std::min(Hi, NumKeys);
+  Pos = std::lower_bound(Keys + Lo, Keys + Hi, K) - Keys;
+  return Pos < NumKeys && Keys[Pos] == K;
+}
+
+void EdgeIndex::removeKnown(std::vector<Key> &Keys) const {
+  for (auto It = Segments.rbegin(); It != Segments.rend() && !Keys.empty();
+       ++It) {
+    std::uint64_t Pos = 0;
+    std::size_t N = 0;
+    for (const Key &K : Keys) {
+      if (!It->find(K, HashKey(K), Pos)) {
+        Keys[N++] = K;
+      }
+    }
+    Keys.resize(N);
+  }
+}
+
+template <typename NextFn>
+bool EdgeIndex::writeSegment(std::uint64_t MaxKeys, NextFn Next,
+                             std::string &Error) {
+  char Name[32];
+  snprintf(Name, sizeof(Name), "%016" PRIx64 "%s", NextSeq, kSegmentSuffix);
+  const std::string Path = Dir + "/" + Name;
+  const std::string TempPath =
+      Dir + "/" + kTempPrefix + std::to_string(getpid());
+
+  FILE *F = fopen(TempPath.c_str(), "wb");
+  if (!F) {
+    Error = "unable to write " + TempPath;
+    return false;
+  }
+
+  // The edges go after the bloom filter, which is only complete once all
+  // edges are written
+  const std::uint64_t BloomBits =
+      std::max<std::uint64_t>(1, (MaxKeys * kBloomBitsPerKey +
+                                  kBloomBlockBits - 1) / kBloomBlockBits) *
+      kBloomBlockBits;
+  std::vector<std::uint64_t> Bloom(BloomBits / 64);
+  SegmentHeader Header = {};
+  memcpy(Header.Magic, kSegmentMagic, sizeof(kSegmentMagic));
+  Header.Version = kSegmentVersion;
+  Header.NumKeys = 0;
+  Header.BloomBits = BloomBits;
+
+  bool Success = !fseek(F, sizeof(Header) + BloomBits / 8, SEEK_SET);
+  Key K;
+  while (Success && Next(K)) {
+    ForEachBloomBit(HashKey(K), BloomBits, [&](std::uint64_t Bit) {
+      Bloom[Bit / 64] |= 1ULL << (Bit % 64);
+    });
+    Success = fwrite(&K, sizeof(K), 1, F) == 1;
+    ++Header.NumKeys;
+  }
+
+  Success = Success && !fseek(F, 0, SEEK_SET) &&
+            fwrite(&Header, sizeof(Header), 1, F) == 1 &&
+            fwrite(Bloom.data(), 8, Bloom.size(), F) == Bloom.size() &&
+            !fflush(F) && !fsync(fileno(F));
+  Success = !fclose(F) && Success;
+  if (!Success || rename(TempPath.c_str(), Path.c_str())) {
+    unlink(TempPath.c_str());
+    Error = "unable to write " + TempPath;
+    return false;
+  }
+
+  // Make the rename durable
+  const int DirFD = ::open(Dir.c_str(), O_RDONLY);
+  if (DirFD >= 0) {
+    fsync(DirFD);
+    close(DirFD);
+  }
+
+  return mapSegment(Name, NextSeq, Error);
+}
+
+bool EdgeIndex::add(std::vector<Key> Keys, std::string &Error) {
+  std::sort(Keys.begin(), Keys.end());
+  Keys.erase(std::unique(Keys.begin(), Keys.end()), Keys.end());
+  removeKnown(Keys);
+  if (Keys.empty()) {
+    return true;
+  }
+
+  std::size_t Pos = 0;
+  if (!writeSegment(Keys.size(),
+                    [&](Key &K) {
+                      if (Pos == Keys.size()) {
+                        return false;
+                      }
+                      K = Keys[Pos++];
+                      return true;
+                    },
+                    Error)) {
+    return false;
+  }
+
+  // Merge the newest segments into the one before them while it is in the
+  // same or a lower size tier, so that tiers strictly decrease from oldest to
+  // newest. There are then O(log N) segments, and as the edges of a segment
+  // merged with newer ones move up at least one tier, each edge is rewritten
+  // O(log N) times.
+  std::size_t First = Segments.size() - 1;
+  std::uint64_t NumKeys = Segments[First].NumKeys;
+  while (First && SizeTier(Segments[First - 1].NumKeys) <= SizeTier(NumKeys)) {
+    NumKeys += Segments[--First].NumKeys;
+  }
+  return First == Segments.size() - 1 || compact(First, Error);
+}
+
+bool EdgeIndex::compact(std::size_t First, std::string &Error) {
+  const std::size_t NumOld = Segments.size();
+  std::uint64_t MaxKeys = 0;
+  for (std::size_t I = First; I < NumOld; ++I) {
+    MaxKeys += Segments[I].NumKeys;
+  }
+
+  // Merge the (sorted) segments, dropping duplicates
+  using Head = std::pair<Key, std::size_t>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> Heads;
+  std::vector<std::uint64_t> Pos(NumOld, 0);
+  for (std::size_t I = First; I < NumOld; ++I) {
+    if (Segments[I].NumKeys) {
+      Heads.push({Segments[I].Keys[Pos[I]++], I});
+    }
+  }
+
+  bool HaveLast = false;
+  Key Last;
+  auto Next = [&](Key &K) {
+    while (!Heads.empty()) {
+      const Head H = Heads.top();
+      Heads.pop();
+      const Segment &Seg = Segments[H.second];
+      if (Pos[H.second] < Seg.NumKeys) {
+        Heads.push({Seg.Keys[Pos[H.second]++], H.second});
+      }
+
+      if (!HaveLast || H.first != Last) {
+        K = Last = H.first;
+        HaveLast = true;
+        return true;
+      }
+    }
+    return false;
+  };
+  if (!writeSegment(MaxKeys, Next, Error)) {
+    return false;
+  }
+
+  // The merged segment is complete, so the old segments can go (if this is
+  // interrupted, the remaining old segments are merely redundant)
+  for (std::size_t I = First; I < NumOld; ++I) {
+    unlink(Segments[I].Path.c_str());
+    munmap(const_cast<void *>(Segments[I].Data), Segments[I].Size);
+  }
+  Segments.erase(Segments.begin() + First, Segments.begin() + NumOld);
+  return true;
+}
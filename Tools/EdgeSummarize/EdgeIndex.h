@@ -0,0 +1,100 @@
+//===-- EdgeIndex.h - Persistent index of executed edges ----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// A persistent, on-disk set of the edges executed by previous runs, so that
+/// the edges first executed by a new run can be found in time proportional to
+/// the size of the new run's log (rather than to the size of the index).
+///
+/// The index is a directory of immutable segments. Each segment holds a
+/// sorted array of edges, fronted by a bloom filter, and is mapped into memory
+/// when the index is opened. New edges are written to a new segment, which is
+/// renamed into place once complete, so that the index is updated atomically.
+/// Segments of similar size are merged (size-tiered compaction), so that an
+/// update costs time proportional to its own size, amortized, rather than to
+/// the size of the index. Segments can overlap, so a merge interrupted part way
+/// leaves a valid index. Updates are serialized by a lock file.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef EDGE_INDEX_H
+#define EDGE_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace edgelog {
+
+class EdgeIndex {
+public:
+  /// An edge (its source and destination block IDs)
+  using Key = std::pair<std::uint64_t, std::uint64_t>;
+
+  /// Open (or create) the index in `Dir`, locking it for update. Returns null
+  /// (and sets `Error`) on failure.
+  static std::unique_ptr<EdgeIndex> open(const std::string &Dir,
+                                         std::string &Error);
+
+  ~EdgeIndex();
+
+  /// Remove the edges that are in the index from the sorted, distinct edges
+  /// `Keys`. The index is searched in order of `Keys`, so that searches run
+  /// mostly sequentially through each segment.
+  void removeKnown(std::vector<Key> &Keys) const;
+
+  /// Add the edges `Keys` to the index. Returns false (and sets `Error`) on
+  /// failure, in which case the index is unchanged.
+  bool add(std::vector<Key> Keys, std::string &Error);
+
+private:
+  struct Segment {
+    std::string Path;
+    std::uint64_t Seq;
+    const void *Data;
+    std::size_t Size;
+
+    const std::uint64_t *Bloom;
+    std::uint64_t BloomBits;
+    const Key *Keys;
+    std::uint64_t NumKeys;
+
+    /// Return true if the segment contains `K` (with hash `Hash`), searching
+    /// from `Pos` (which is left at the position of `K`)
+    bool find(const Key &K, std::uint64_t Hash, std::uint64_t &Pos) const;
+  };
+
+  EdgeIndex(const std::string &D, int Lock) : Dir(D), LockFD(Lock) {}
+
+  bool load(std::string &Error);
+  bool mapSegment(const std::string &Name, std::uint64_t Seq,
+                  std::string &Error);
+
+  /// Write the sorted, distinct edges produced by `Next` (at most `MaxKeys`
+  /// of them) to a new segment
+  template <typename NextFn>
+  bool writeSegment(std::uint64_t MaxKeys, NextFn Next, std::string &Error);
+
+  /// Merge the segments from `First` on (i.e., the newest) into one
+  bool compact(std::size_t First, std::string &Error);
+
+  const std::string Dir;
+  const int LockFD;
+
+  /// Segments, oldest first
+  std::vector<Segment> Segments;
+  std::uint64_t NextSeq = 0;
+};
+
+} // namespace edgelog
+
+#endif // EDGE_INDEX_H
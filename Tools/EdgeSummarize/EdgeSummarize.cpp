@@ -0,0 +1,1108 @@
+//===-- EdgeSummarize.cpp - Summarize executed edges ---------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// A native replacement for summarize_edges.py, with the same command line
+/// and output. Counts the edges executed in each log, and prints them as a
+/// table (or writes them to CSV).
+///
+/// CSV logs (traces or edge counts) are mapped into memory and split between
+/// worker threads, each of which counts edges in a hash table of its own. The
+/// tables are merged once all threads are done. Edges are reported in the
+/// order in which they first occur in the log. Binary logs are decoded with
+/// the edge log reader.
+///
+/// Compressed CSV logs are decompressed as they are summarized: the main
+/// thread decompresses the log into blocks of whole rows, which are queued
+/// for the workers. Only a few blocks are in flight at a time, so memory use
+/// does not depend on the size of the log.
+///
+/// With `--merge`, the logs are folded into a single table of edges (block IDs
+/// do not depend on where modules are loaded), with each edge's total count
+/// and the number of logs it occurs in. Each log is counted on its own and
+/// then added to the merged table. When the merged table outgrows its memory
+/// budget, it is sorted and spilled to a temporary file, and the spilled runs
+/// are merged on output.
+///
+/// With `--index`, only the edges that no earlier run executed are reported.
+/// The edges of earlier runs are kept in an on-disk index (see EdgeIndex.h),
+/// which is updated with the new edges once all logs are summarized.
+///
+//===----------------------------------------------------------------------===//
+
+#include <algorithm>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+#include "EdgeIndex.h"
+#include "EdgeLogFormat.h"
+#include "EdgeLogReader.h"
+
+using namespace edgelog;
+
+/// Number of slots in an empty edge table
+static const std::size_t kInitialTableSize = 1 << 12;
+
+/// Size of the blocks a compressed log is decompressed into
+static const std::size_t kStreamBlockSize = 4 << 20;
+
+/// Default memory budget of the merged table (in MiB)
+static const std::size_t kDefaultMergeMemory = 1024;
+
+/// Number of merged edges buffered from each spilled run
+static const std::size_t kRunBufferSize = 1 << 14;
+
+namespace {
+
+/// An executed edge, its count and the position of its first occurrence
+struct EdgeCount {
+  std::uint64_t Prev;
+  std::uint64_t Cur;
+  std::uint64_t Count;
+  /// Offset of the log row the edge first occurs in, and the edge's index in
+  /// the row (rows expand to more than one edge when restoring pruned blocks)
+  std::uint64_t Pos;
+  std::uint32_t Sub;
+  bool Used;
+
+  bool operator<(const EdgeCount &Other) const {
+    return Pos < Other.Pos || (Pos == Other.Pos && Sub < Other.Sub);
+  }
+};
+
+/// Counts edges in an open-addressed hash table
+class EdgeTable {
+public:
+  EdgeTable() : Slots(kInitialTableSize) {}
+
+  void add(std::uint64_t Prev, std::uint64_t Cur, std::uint64_t Count,
+           std::uint64_t Pos, std::uint32_t Sub);
+
+  /// Add the counts in `Other` to this table
+  void merge(const EdgeTable &Other);
+
+  /// Return the edges in the table, in order of first occurrence
+  std::vector<EdgeCount> sorted() const;
+
+  /// Call `Fn(E)` for each edge in the table (in no particular order)
+  template <typename FnT> void forEach(FnT Fn) const {
+    for (const auto &E : Slots) {
+      if (E.Used) {
+        Fn(E);
+      }
+    }
+  }
+
+private:
+  void grow();
+
+  std::vector<EdgeCount> Slots;
+  std::size_t NumEdges = 0;
+};
+
+/// An edge's total count across logs, and the number of logs it occurs in
+struct MergedEdge {
+  std::uint64_t Prev;
+  std::uint64_t Cur;
+  std::uint64_t Count;
+  std::uint64_t Logs;
+
+  bool operator<(const MergedEdge &Other) const {
+    return Prev < Other.Prev || (Prev == Other.Prev && Cur < Other.Cur);
+  }
+};
+
+/// Folds the edges of any number of logs into a single table, spilling
+/// sorted runs of it to temporary files to stay within a memory budget
+class EdgeMerger {
+public:
+  explicit EdgeMerger(std::size_t Budget);
+  ~EdgeMerger();
+
+  /// Add the edges of a log. Returns false on failure to spill.
+  bool add(const EdgeTable &Log);
+
+  /// Call `Fn(E)` for each merged edge, in order of block IDs. Can only be
+  /// called once. Returns false on failure to read a spilled run.
+  template <typename FnT> bool finish(FnT Fn);
+
+private:
+  void insert(const MergedEdge &E);
+  bool spill();
+
+  const std::size_t MaxSlots;
+
+  /// Open-addressed table of edges (unused slots have no logs)
+  std::vector<MergedEdge> Slots;
+  std::size_t NumEdges = 0;
+
+  /// The spilled runs (unlinked temporary files)
+  std::vector<FILE *> Runs;
+};
+
+/// The columns of a CSV log
+struct Columns {
+  int PrevID = -1;
+  int CurID = -1;
+  int Count = -1;
+};
+
+} // end anonymous namespace
+
+static std::size_t HashEdge(std::uint64_t Prev, std::uint64_t Cur) {
+  std::uint64_t H = (Prev * 0x9e3779b97f4a7c15ULL) ^ Cur;
+  H ^= H >> 29;
+  H *= 0xbf58476d1ce4e5b9ULL;
+  return static_cast<std::size_t>(H ^ (H >> 32));
+}
+
+void EdgeTable::add(std::uint64_t Prev, std::uint64_t Cur, std::uint64_t Count,
+                    std::uint64_t Pos, std::uint32_t Sub) {
+  const std::size_t Mask = Slots.size() - 1;
+  for (std::size_t I = HashEdge(Prev, Cur) & Mask;; I = (I + 1) & Mask) {
+    EdgeCount &E = Slots[I];
+    if (!E.Used) {
+      E = {Prev, Cur, Count, Pos, Sub, true};
+      if (++NumEdges * 2 > Slots.size()) {
+        grow();
+      }
+      return;
+    }
+    if (E.Prev == Prev && E.Cur == Cur) {
+      E.Count += Count;
+      if (Pos < E.Pos || (Pos == E.Pos && Sub < E.Sub)) {
+        E.Pos = Pos;
+        E.Sub = Sub;
+      }
+      return;
+    }
+  }
+}
+
+void EdgeTable::grow() {
+  std::vector<EdgeCount> Old(2 * Slots.size());
+  Old.swap(Slots);
+  NumEdges = 0;
+  for (const auto &E : Old) {
+    if (E.Used) {
+      add(E.Prev, E.Cur, E.Count, E.Pos, E.Sub);
+    }
+  }
+}
+
+void EdgeTable::merge(const EdgeTable &Other) {
+  for (const auto &E : Other.Slots) {
+    if (E.Used) {
+      add(E.Prev, E.Cur, E.Count, E.Pos, E.Sub);
+    }
+  }
+}
+
+std::vector<EdgeCount> EdgeTable::sorted() const {
+  std::vector<EdgeCount> Edges;
+  Edges.reserve(NumEdges);
+  for (const auto &E : Slots) {
+    if (E.Used) {
+      Edges.push_back(E);
+    }
+  }
+  std::sort(Edges.begin(), Edges.end());
+  return Edges;
+}
+
+EdgeMerger::EdgeMerger(std::size_t Budget)
+    : MaxSlots(std::max<std::size_t>(kInitialTableSize,
+                                     Budget / sizeof(MergedEdge))),
+      Slots(kInitialTableSize) {}
+
+EdgeMerger::~EdgeMerger() {
+  for (FILE *Run : Runs) {
+    fclose(Run);
+  }
+}
+
+void EdgeMerger::insert(const MergedEdge &E) {
+  const std::size_t Mask = Slots.size() - 1;
+  for (std::size_t I = HashEdge(E.Prev, E.Cur) & Mask;; I = (I + 1) & Mask) {
+    MergedEdge &Slot = Slots[I];
+    if (!Slot.Logs) {
+      Slot = E;
+      ++NumEdges;
+      return;
+    }
+    if (Slot.Prev == E.Prev && Slot.Cur == E.Cur) {
+      Slot.Count += E.Count;
+      Slot.Logs += E.Logs;
+      return;
+    }
+  }
+}
+
+bool EdgeMerger::add(const EdgeTable &Log) {
+  bool Success = true;
+  Log.forEach([&](const EdgeCount &E) {
+    if ((NumEdges + 1) * 2 > Slots.size()) {
+      if (2 * Slots.size() <= MaxSlots) {
+        std::vector<MergedEdge> Old(2 * Slots.size());
+        Old.swap(Slots);
+        NumEdges = 0;
+        for (const auto &M : Old) {
+          if (M.Logs) {
+            insert(M);
+          }
+        }
+      } else {
+        Success &= spill();
+      }
+    }
+    insert({E.Prev, E.Cur, E.Count, 1});
+  });
+  return Success;
+}
+
+/// Sort the edges in the table and write them to a new run, emptying the
+/// table
+bool EdgeMerger::spill() {
+  const char *Dir = getenv("TMPDIR");
+  std::string Path = std::string(Dir ? Dir : "/tmp") + "/edge-merge-XXXXXX";
+  const int FD = mkstemp(&Path[0]);
+  if (FD < 0) {
+    return false;
+  }
+  unlink(Path.c_str());
+
+  FILE *Run = fdopen(FD, "w+b");
+  if (!Run) {
+    close(FD);
+    return false;
+  }
+  Runs.push_back(Run);
+
+  // Sort in place, so that spilling needs no more memory
+  auto End = std::remove_if(Slots.begin(), Slots.end(),
+                            [](const MergedEdge &E) { return !E.Logs; });
+  std::sort(Slots.begin(), End);
+  const std::size_t N = End - Slots.begin();
+  const bool Success = fwrite(Slots.data(), sizeof(MergedEdge), N, Run) == N;
+
+  std::fill(Slots.begin(), Slots.end(), MergedEdge{0, 0, 0, 0});
+  NumEdges = 0;
+  return Success;
+}
+
+template <typename FnT> bool EdgeMerger::finish(FnT Fn) {
+  auto End = std::remove_if(Slots.begin(), Slots.end(),
+                            [](const MergedEdge &E) { return !E.Logs; });
+  std::sort(Slots.begin(), End);
+  Slots.erase(End, Slots.end());
+
+  // Merge the table and the runs (the table is source 0)
+  struct Source {
+    std::vector<MergedEdge> Buf;
+    std::size_t Pos;
+    FILE *Run;
+  };
+  std::vector<Source> Sources;
+  Sources.push_back({std::move(Slots), 0, nullptr});
+  for (FILE *Run : Runs) {
+    rewind(Run);
+    Sources.push_back({std::vector<MergedEdge>(), 0, Run});
+  }
+
+  bool Success = true;
+  auto Refill = [&](Source &S) {
+    if (S.Pos < S.Buf.size() || !S.Run) {
+      return S.Pos < S.Buf.size();
+    }
+    S.Buf.resize(kRunBufferSize);
+    S.Buf.resize(fread(S.Buf.data(), sizeof(MergedEdge), S.Buf.size(), S.Run));
+    Success &= !ferror(S.Run);
+    S.Pos = 0;
+    return !S.Buf.empty();
+  };
+
+  using Head = std::pair<MergedEdge, std::size_t>;
+  auto Later = [](const Head &A, const Head &B) { return B.first < A.first; };
+  std::priority_queue<Head, std::vector<Head>, decltype(Later)> Heads(Later);
+  for (std::size_t I = 0; I < Sources.size(); ++I) {
+    if (Refill(Sources[I])) {
+      Heads.push({Sources[I].Buf[Sources[I].Pos++], I});
+    }
+  }
+
+  bool HaveCur = false;
+  MergedEdge Cur;
+  while (!Heads.empty()) {
+    const Head H = Heads.top();
+    Heads.pop();
+    Source &S = Sources[H.second];
+    if (Refill(S)) {
+      Heads.push({S.Buf[S.Pos++], H.second});
+    }
+
+    if (HaveCur && Cur.Prev == H.first.Prev && Cur.Cur == H.first.Cur) {
+      Cur.Count += H.first.Count;
+      Cur.Logs += H.first.Logs;
+      continue;
+    }
+    if (HaveCur) {
+      Fn(Cur);
+    }
+    Cur = H.first;
+    HaveCur = true;
+  }
+  if (HaveCur) {
+    Fn(Cur);
+  }
+
+  return Success;
+}
+
+/// Parse the decimal integer at [`P`, `End`) into `V`
+static bool ParseUInt64(const char *P, const char *End, std::uint64_t &V) {
+  if (P == End) {
+    return false;
+  }
+
+  V = 0;
+  for (; P < End; ++P) {
+    if (*P < '0' || *P > '9') {
+      return false;
+    }
+    V = V * 10 + (*P - '0');
+  }
+  return true;
+}
+
+/// Return the end of the line starting at `P`, excluding any line terminator
+static const char *LineEnd(const char *P, const char *End, const char *&Next) {
+  const char *NL = static_cast<const char *>(memchr(P, '\n', End - P));
+  Next = NL ? NL + 1 : End;
+  const char *E = NL ? NL : End;
+  return E > P && E[-1] == '\r' ? E - 1 : E;
+}
+
+/// Find the log's columns in its header row
+static bool ParseHeader(const char *P, const char *End, Columns &Cols) {
+  for (int I = 0; P <= End; ++I) {
+    const char *Comma = static_cast<const char *>(memchr(P, ',', End - P));
+    const char *FieldEnd = Comma ? Comma : End;
+    const std::string Name(P, FieldEnd);
+
+    if (Name == "prev_id") {
+      Cols.PrevID = I;
+    } else if (Name == "cur_id") {
+      Cols.CurID = I;
+    } else if (Name == "count") {
+      Cols.Count = I;
+    }
+    P = FieldEnd + 1;
+  }
+  return Cols.PrevID >= 0 && Cols.CurID >= 0;
+}
+
+/// Count the edges in the rows in [`Begin`, `End`) (which start at a row
+/// boundary, at `Offset` in the log). Returns false if a row is malformed.
+static bool ParseRows(const char *Begin, const char *End, std::uint64_t Offset,
+                      const Columns &Cols, const ImpliedBlockMap &Implied,
+                      EdgeTable &Table) {
+  std::vector<std::uint64_t> Blocks;
+
+  for (const char *P = Begin, *Next; P < End; P = Next) {
+    const char *Row = P;
+    const char *RowEnd = LineEnd(P, End, Next);
+    if (Row == RowEnd) {
+      continue;
+    }
+
+    std::uint64_t Prev = 0, Cur = 0, Count = 1;
+    int Found = 0;
+    for (int I = 0; P <= RowEnd; ++I) {
+      const char *Comma =
+          static_cast<const char *>(memchr(P, ',', RowEnd - P));
+      const char *FieldEnd = Comma ? Comma : RowEnd;
+
+      bool OK = true;
+      if (I == Cols.PrevID) {
+        OK = ParseUInt64(P, FieldEnd, Prev);
+        ++Found;
+      } else if (I == Cols.CurID) {
+        OK = ParseUInt64(P, FieldEnd, Cur);
+        ++Found;
+      } else if (I == Cols.Count) {
+        OK = ParseUInt64(P, FieldEnd, Count);
+      }
+      if (!OK) {
+        return false;
+      }
+      P = FieldEnd + 1;
+    }
+    if (Found != 2) {
+      return false;
+    }
+
+    const std::uint64_t Pos = Offset + (Row - Begin);
+    if (Implied.empty()) {
+      Table.add(Prev, Cur, Count, Pos, 0);
+      continue;
+    }
+
+    // Restore the unlogged blocks executed between `Prev` and `Cur`
+    Blocks.assign(1, Cur);
+    for (auto It = Implied.find(Cur); It != Implied.end();
+         It = Implied.find(Blocks.back())) {
+      Blocks.push_back((Cur & ~0xffffffffULL) | It->second);
+    }
+    std::uint32_t Sub = 0;
+    for (auto It = Blocks.rbegin(); It != Blocks.rend(); ++It) {
+      Table.add(Prev, *It, Count, Pos, Sub++);
+      Prev = *It;
+    }
+  }
+
+  return true;
+}
+
+/// Count the edges in the CSV log at [`Data`, `Data + Size`) on `NumJobs`
+/// threads
+static bool SummarizeCSV(const char *Data, std::size_t Size,
+                         const ImpliedBlockMap &Implied, unsigned NumJobs,
+                         EdgeTable &Table) {
+  const char *End = Data + Size;
+  const char *Begin;
+  const char *HeaderEnd = LineEnd(Data, End, Begin);
+  Columns Cols;
+  if (!ParseHeader(Data, HeaderEnd, Cols)) {
+    return false;
+  }
+
+  // Split the rows between threads, at row boundaries
+  std::vector<const char *> Bounds(1, Begin);
+  for (unsigned I = 1; I < NumJobs; ++I) {
+    const char *P =
+        std::max(Bounds.back(), Begin + (End - Begin) * I / NumJobs);
+    const char *NL = static_cast<const char *>(memchr(P, '\n', End - P));
+    Bounds.push_back(NL ? NL + 1 : End);
+  }
+  Bounds.push_back(End);
+
+  std::vector<EdgeTable> Tables(NumJobs);
+  std::vector<char> Success(NumJobs);
+  std::vector<std::thread> Workers;
+  for (unsigned I = 0; I < NumJobs; ++I) {
+    Workers.emplace_back([&, I]() {
+      Success[I] = ParseRows(Bounds[I], Bounds[I + 1], Bounds[I] - Data, Cols,
+                             Implied, Tables[I]);
+    });
+  }
+  for (auto &Worker : Workers) {
+    Worker.join();
+  }
+
+  if (std::find(Success.begin(), Success.end(), false) != Success.end()) {
+    return false;
+  }
+
+  Table = std::move(Tables[0]);
+  for (unsigned I = 1; I < NumJobs; ++I) {
+    Table.merge(Tables[I]);
+    Tables[I] = EdgeTable();
+  }
+  return true;
+}
+
+/// Count the edges in the compressed CSV log `File`, decompressing it on the
+/// calling thread while `NumJobs` threads count edges
+static bool SummarizeCompressedCSV(gzFile File, const ImpliedBlockMap &Implied,
+                                   unsigned NumJobs, EdgeTable &Table) {
+  struct Block {
+    std::vector<char> Data;
+    std::uint64_t Offset;
+  };
+
+  std::mutex Mutex;
+  std::condition_variable WorkReady;
+  std::condition_variable BlockFree;
+  std::deque<Block> Queue;
+  std::vector<std::vector<char>> FreeBuffers(2 * NumJobs);
+  bool Done = false;
+  bool Failed = false;
+  Columns Cols;
+
+  std::vector<EdgeTable> Tables(NumJobs);
+  std::vector<std::thread> Workers;
+  for (unsigned I = 0; I < NumJobs; ++I) {
+    Workers.emplace_back([&, I]() {
+      std::unique_lock<std::mutex> Lock(Mutex);
+      while (true) {
+        WorkReady.wait(Lock, [&]() { return !Queue.empty() || Done; });
+        if (Queue.empty()) {
+          return;
+        }
+
+        Block B = std::move(Queue.front());
+        Queue.pop_front();
+        Lock.unlock();
+        const bool OK = ParseRows(B.Data.data(), B.Data.data() + B.Data.size(),
+                                  B.Offset, Cols, Implied, Tables[I]);
+        Lock.lock();
+
+        Failed |= !OK;
+        FreeBuffers.push_back(std::move(B.Data));
+        BlockFree.notify_one();
+      }
+    });
+  }
+
+  // Decompress the log into blocks that end at a row boundary (the partial
+  // row at the end of a block is carried over to the next). The columns are
+  // known before the first block is queued.
+  std::vector<char> Carry;
+  std::uint64_t Offset = 0;
+  bool Header = true;
+  bool ReadError = false;
+  while (true) {
+    std::vector<char> Buf;
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+      BlockFree.wait(Lock, [&]() { return !FreeBuffers.empty(); });
+      Buf = std::move(FreeBuffers.back());
+      FreeBuffers.pop_back();
+    }
+
+    Buf.assign(Carry.begin(), Carry.end());
+    Buf.resize(Carry.size() + kStreamBlockSize);
+    const int N = gzread(File, Buf.data() + Carry.size(), kStreamBlockSize);
+    if (N < 0) {
+      ReadError = true;
+      break;
+    }
+    Buf.resize(Carry.size() + N);
+
+    const bool End = N == 0;
+    std::size_t Len = Buf.size();
+    if (!End) {
+      while (Len && Buf[Len - 1] != '\n') {
+        --Len;
+      }
+    }
+    Carry.assign(Buf.begin() + Len, Buf.end());
+    Buf.resize(Len);
+
+    if (Header && (Len || End)) {
+      const char *Next;
+      const char *HeaderEnd = LineEnd(Buf.data(), Buf.data() + Len, Next);
+      if (!ParseHeader(Buf.data(), HeaderEnd, Cols)) {
+        ReadError = true;
+        break;
+      }
+      Header = false;
+      Offset = Next - Buf.data();
+      Buf.erase(Buf.begin(), Buf.begin() + Offset);
+      Len = Buf.size();
+    }
+
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Queue.push_back({std::move(Buf), Offset});
+    }
+    WorkReady.notify_one();
+    Offset += Len;
+
+    if (End) {
+      break;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Done = true;
+  }
+  WorkReady.notify_all();
+  for (auto &Worker : Workers) {
+    Worker.join();
+  }
+  if (ReadError || Failed) {
+    return false;
+  }
+
+  Table = std::move(Tables[0]);
+  for (unsigned I = 1; I < NumJobs; ++I) {
+    Table.merge(Tables[I]);
+    Tables[I] = EdgeTable();
+  }
+  return true;
+}
+
+/// Count the edges in the binary log at `Path`
+static bool SummarizeBinary(const char *Path, const char *MapDir,
+                            EdgeTable &Table, std::string &Error) {
+  auto Reader = EdgeLogReader::open(Path, Error);
+  if (!Reader || (MapDir && !Reader->loadBlockMaps(MapDir, Error))) {
+    return false;
+  }
+
+  Edge E;
+  for (std::uint64_t Pos = 0; Reader->next(E); ++Pos) {
+    Table.add(E.Prev.getID(), E.Cur.getID(), 1, Pos, 0);
+  }
+
+  Error = Reader->getError();
+  return Error.empty();
+}
+
+/// Count the edges in the log at `Path`
+static bool Summarize(const char *Path, const char *MapDir,
+                      const ImpliedBlockMap &Implied, unsigned NumJobs,
+                      EdgeTable &Table, std::string &Error) {
+  const int FD = open(Path, O_RDONLY);
+  struct stat Stat;
+  if (FD < 0 || fstat(FD, &Stat)) {
+    if (FD >= 0) {
+      close(FD);
+    }
+    Error = std::string("unable to open ") + Path;
+    return false;
+  }
+
+  const std::size_t Size = Stat.st_size;
+  void *Data = Size ? mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, FD, 0)
+                    : nullptr;
+  close(FD);
+  if (Data == MAP_FAILED) {
+    Error = std::string("unable to read ") + Path;
+    return false;
+  }
+  madvise(Data, Size, MADV_SEQUENTIAL);
+
+  // Compressed logs are read through zlib (which also decompresses binary
+  // logs for the reader)
+  const std::uint8_t *Bytes = static_cast<const std::uint8_t *>(Data);
+  const bool Compressed = Size >= 2 && Bytes[0] == 0x1f && Bytes[1] == 0x8b;
+  bool Binary =
+      Size >= sizeof(kMagic) && !memcmp(Data, kMagic, sizeof(kMagic));
+  gzFile File = nullptr;
+  if (Compressed) {
+    char Magic[sizeof(kMagic)];
+    File = gzopen(Path, "rb");
+    if (File && gzread(File, Magic, sizeof(Magic)) == sizeof(Magic) &&
+        !memcmp(Magic, kMagic, sizeof(kMagic))) {
+      Binary = true;
+    }
+    if (File && gzrewind(File)) {
+      gzclose(File);
+      File = nullptr;
+    }
+  }
+
+  bool Success;
+  if (Binary) {
+    Success = SummarizeBinary(Path, MapDir, Table, Error);
+  } else if (Compressed) {
+    Success = File && SummarizeCompressedCSV(File, Implied, NumJobs, Table);
+    if (!Success) {
+      Error = std::string(Path) + ": malformed edge log";
+    }
+  } else {
+    Success = !Size || SummarizeCSV(static_cast<const char *>(Data), Size,
+                                     Implied, NumJobs, Table);
+    if (!Success) {
+      Error = std::string(Path) + ": malformed edge log";
+    }
+  }
+
+  if (File) {
+    gzclose(File);
+  }
+  if (Size) {
+    munmap(Data, Size);
+  }
+  return Success;
+}
+
+/// Normalize `Path` as Python's `str(Path(...))` does
+static std::string NormalizePath(const std::string &Path) {
+  std::string Result;
+  std::size_t I = 0;
+  if (!Path.empty() && Path[0] == '/') {
+    Result = Path.compare(0, 2, "//") || !Path.compare(0, 3, "///") ? "/"
+                                                                    : "//";
+    I = Path.find_first_not_of('/');
+  }
+
+  while (I < Path.size()) {
+    std::size_t Slash = Path.find('/', I);
+    if (Slash == std::string::npos) {
+      Slash = Path.size();
+    }
+    const std::string Part = Path.substr(I, Slash - I);
+    if (!Part.empty() && Part != ".") {
+      if (!Result.empty() && Result.back() != '/') {
+        Result += '/';
+      }
+      Result += Part;
+    }
+    I = Slash + 1;
+  }
+
+  return Result.empty() ? "." : Result;
+}
+
+/// Quote `Field` for CSV output (as Python's csv module does by default)
+static std::string QuoteCSV(const std::string &Field) {
+  if (Field.find_first_of(",\"\r\n") == std::string::npos) {
+    return Field;
+  }
+
+  std::string Result = "\"";
+  for (char C : Field) {
+    if (C == '"') {
+      Result += '"';
+    }
+    Result += C;
+  }
+  return Result + "\"";
+}
+
+static std::string Hex(std::uint64_t V) {
+  char Buf[32];
+  snprintf(Buf, sizeof(Buf), "0x%" PRIx64, V);
+  return Buf;
+}
+
+/// The results for each log (in order of first appearance)
+using Results = std::vector<std::pair<std::string, std::vector<EdgeCount>>>;
+
+static bool WriteCSV(const char *Path, const Results &Logs) {
+  FILE *Out = fopen(Path, "w");
+  if (!Out) {
+    return false;
+  }
+
+  fprintf(Out, "log,prev_id,cur_id,count\r\n");
+  for (const auto &Log : Logs) {
+    const std::string Name = QuoteCSV(Log.first);
+    for (const auto &E : Log.second) {
+      fprintf(Out, "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\r\n", Name.c_str(),
+              E.Prev, E.Cur, E.Count);
+    }
+  }
+
+  return !fclose(Out);
+}
+
+/// Print a table in tabulate's "simple" format. Numeric columns are
+/// right-aligned (unless there are no rows).
+static void PrintTable(const std::vector<std::string> &Headers,
+                       const std::vector<bool> &Numeric,
+                       const std::vector<std::vector<std::string>> &Rows) {
+  const std::size_t NumColumns = Headers.size();
+  std::vector<std::size_t> Widths(NumColumns);
+  for (std::size_t I = 0; I < NumColumns; ++I) {
+    Widths[I] = Headers[I].size() + 2;
+    for (const auto &Row : Rows) {
+      Widths[I] = std::max(Widths[I], Row[I].size());
+    }
+  }
+
+  auto PrintRow = [&](const std::vector<std::string> &Cells) {
+    std::string Line;
+    for (std::size_t I = 0; I < NumColumns; ++I) {
+      const std::string Pad(Widths[I] - Cells[I].size(), ' ');
+      Line += I ? "  " : "";
+      Line += Numeric[I] && !Rows.empty() ? Pad + Cells[I] : Cells[I] + Pad;
+    }
+    Line.erase(Line.find_last_not_of(' ') + 1);
+    printf("%s\n", Line.c_str());
+  };
+
+  std::vector<std::string> Rules;
+  for (std::size_t Width : Widths) {
+    Rules.emplace_back(Width, '-');
+  }
+
+  PrintRow(Headers);
+  PrintRow(Rules);
+  for (const auto &Row : Rows) {
+    PrintRow(Row);
+  }
+}
+
+/// Print the results for each log as a table
+static void PrintTable(const Results &Logs) {
+  std::vector<std::vector<std::string>> Rows;
+  for (const auto &Log : Logs) {
+    for (const auto &E : Log.second) {
+      Rows.push_back(
+          {Log.first, Hex(E.Prev), Hex(E.Cur), std::to_string(E.Count)});
+    }
+  }
+
+  PrintTable({"log", "prev_id", "cur_id", "count"},
+             {false, false, false, true}, Rows);
+}
+
+/// Merge the edges of all logs, and print them as a table or write them to
+/// CSV
+static int Merge(const std::vector<const char *> &LogPaths,
+                 const char *MapDir, const ImpliedBlockMap &Implied,
+                 unsigned NumJobs, std::size_t Budget, const char *CSVPath) {
+  std::string Error;
+  EdgeMerger Merger(Budget);
+  for (const char *Path : LogPaths) {
+    EdgeTable Table;
+    if (!Summarize(Path, MapDir, Implied, NumJobs, Table, Error)) {
+      fprintf(stderr, "error: %s\n", Error.c_str());
+      return 1;
+    }
+    if (!Merger.add(Table)) {
+      fprintf(stderr, "error: unable to write temporary file\n");
+      return 1;
+    }
+  }
+
+  FILE *Out = CSVPath ? fopen(CSVPath, "w") : nullptr;
+  if (CSVPath && !Out) {
+    fprintf(stderr, "error: unable to write %s\n", CSVPath);
+    return 1;
+  }
+
+  std::vector<std::vector<std::string>> Rows;
+  if (Out) {
+    fprintf(Out, "prev_id,cur_id,count,logs\r\n");
+  }
+  const bool Success = Merger.finish([&](const MergedEdge &E) {
+    if (Out) {
+      fprintf(Out, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\r\n",
+              E.Prev, E.Cur, E.Count, E.Logs);
+    } else {
+      Rows.push_back({Hex(E.Prev), Hex(E.Cur), std::to_string(E.Count),
+                      std::to_string(E.Logs)});
+    }
+  });
+
+  if (Out && fclose(Out)) {
+    fprintf(stderr, "error: unable to write %s\n", CSVPath);
+    return 1;
+  }
+  if (!Success) {
+    fprintf(stderr, "error: unable to read temporary file\n");
+    return 1;
+  }
+
+  if (!Out) {
+    PrintTable({"prev_id", "cur_id", "count", "logs"},
+               {false, false, true, true}, Rows);
+  }
+  return 0;
+}
+
+static void Usage(const char *Argv0) {
+  fprintf(stderr,
+          "usage: %s [-c CSV] [-m MAP_DIR] [-j JOBS] [--merge] "
+          "[--memory MIB] [--index DIR] LOG [LOG ...]\n",
+          Argv0);
+}
+
+int main(int argc, char *argv[]) {
+  const char *CSVPath = nullptr;
+  const char *MapDir = nullptr;
+  const char *IndexDir = nullptr;
+  unsigned NumJobs = std::max(1U, std::thread::hardware_concurrency());
+  bool MergeLogs = false;
+  std::size_t MergeMemory = kDefaultMergeMemory;
+  std::vector<const char *> LogPaths;
+
+  for (int I = 1; I < argc; ++I) {
+    const std::string Arg = argv[I];
+    const std::size_t Eq = Arg.find('=');
+    const std::string Opt = Arg.compare(0, 2, "--") ? Arg : Arg.substr(0, Eq);
+
+    const char **Value = nullptr;
+    const char *Jobs = nullptr;
+    const char *Memory = nullptr;
+    if (Arg == "--merge") {
+      MergeLogs = true;
+      continue;
+    } else if (Opt == "-c" || Opt == "--csv") {
+      Value = &CSVPath;
+    } else if (Opt == "-m" || Opt == "--map-dir") {
+      Value = &MapDir;
+    } else if (Opt == "-j" || Opt == "--jobs") {
+      Value = &Jobs;
+    } else if (Opt == "--memory") {
+      Value = &Memory;
+    } else if (Opt == "--index") {
+      Value = &IndexDir;
+    } else {
+      LogPaths.push_back(argv[I]);
+      continue;
+    }
+
+    if (Opt != Arg) {
+      *Value = argv[I] + Eq + 1;
+    } else if (I + 1 < argc) {
+      *Value = argv[++I];
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+    if (Jobs) {
+      NumJobs = std::max(1UL, strtoul(Jobs, nullptr, 10));
+    }
+    if (Memory) {
+      MergeMemory = strtoul(Memory, nullptr, 10);
+    }
+  }
+
+  if (LogPaths.empty() || (MergeLogs && IndexDir)) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  std::string Error;
+  ImpliedBlockMap Implied;
+  if (MapDir && !LoadBlockMaps(MapDir, Implied, Error)) {
+    fprintf(stderr, "error: %s\n", Error.c_str());
+    return 1;
+  }
+
+  // Open the index first, so that concurrent runs are serialized
+  std::unique_ptr<EdgeIndex> Index;
+  if (IndexDir && !(Index = EdgeIndex::open(IndexDir, Error))) {
+    fprintf(stderr, "error: %s\n", Error.c_str());
+    return 1;
+  }
+
+  if (MergeLogs) {
+    return Merge(LogPaths, MapDir, Implied, NumJobs, MergeMemory << 20,
+                 CSVPath);
+  }
+
+  Results Logs;
+  for (const char *Path : LogPaths) {
+    std::vector<EdgeCount> Edges;
+    {
+      EdgeTable Table;
+      if (!Summarize(Path, MapDir, Implied, NumJobs, Table, Error)) {
+        fprintf(stderr, "error: %s\n", Error.c_str());
+        return 1;
+      }
+      Edges = Table.sorted();
+    }
+    if (Edges.empty()) {
+      continue;
+    }
+
+    const std::string Name = NormalizePath(Path);
+    auto It = std::find_if(Logs.begin(), Logs.end(),
+                           [&](const Results::value_type &Log) {
+                             return Log.first == Name;
+                           });
+    if (It == Logs.end()) {
+      Logs.emplace_back(Name, std::move(Edges));
+      continue;
+    }
+
+    // A log given more than once (or under different names) is summarized
+    // once, with edges first seen in a later copy ordered after the rest
+    EdgeTable Table;
+    std::uint64_t Pos = 0;
+    for (const auto *Log : {&It->second, &Edges}) {
+      for (const auto &E : *Log) {
+        Table.add(E.Prev, E.Cur, E.Count, Pos++, 0);
+      }
+    }
+    It->second = Table.sorted();
+  }
+
+  // Only report the edges that are new to the index (in the first log that
+  // executes them). Each log's edges are looked up in order of block IDs,
+  // and the new edges of earlier logs are kept sorted.
+  std::vector<EdgeIndex::Key> NewEdges;
+  if (Index) {
+    for (auto &Log : Logs) {
+      auto &Edges = Log.second;
+      std::sort(Edges.begin(), Edges.end(),
+                [](const EdgeCount &A, const EdgeCount &B) {
+                  return A.Prev < B.Prev || (A.Prev == B.Prev && A.Cur < B.Cur);
+                });
+
+      std::vector<EdgeIndex::Key> Keys;
+      Keys.reserve(Edges.size());
+      for (const auto &E : Edges) {
+        Keys.emplace_back(E.Prev, E.Cur);
+      }
+      Index->removeKnown(Keys);
+
+      std::size_t N = 0, NumEarlier = NewEdges.size();
+      auto K = Keys.begin();
+      auto Earlier = NewEdges.begin();
+      for (const auto &E : Edges) {
+        const EdgeIndex::Key Key(E.Prev, E.Cur);
+        if (K == Keys.end() || *K != Key) {
+          continue;
+        }
+        ++K;
+        Earlier = std::lower_bound(Earlier, NewEdges.begin() + NumEarlier, Key);
+        if (Earlier == NewEdges.begin() + NumEarlier || *Earlier != Key) {
+          Edges[N++] = E;
+        }
+      }
+      Edges.resize(N);
+      std::sort(Edges.begin(), Edges.end());
+
+      for (const auto &E : Edges) {
+        NewEdges.emplace_back(E.Prev, E.Cur);
+      }
+      std::sort(NewEdges.begin() + NumEarlier, NewEdges.end());
+      std::inplace_merge(NewEdges.begin(), NewEdges.begin() + NumEarlier,
+                         NewEdges.end());
+    }
+    Logs.erase(std::remove_if(Logs.begin(), Logs.end(),
+                              [](const Results::value_type &Log) {
+                                return Log.second.empty();
+                              }),
+               Logs.end());
+  }
+
+  if (CSVPath) {
+    if (!WriteCSV(CSVPath, Logs)) {
+      fprintf(stderr, "error: unable to write %s\n", CSVPath);
+      return 1;
+    }
+  } else {
+    PrintTable(Logs);
+  }
+
+  // The index is only updated once the new edges have been reported
+  if (Index && !Index->add(std::move(NewEdges), Error)) {
+    fprintf(stderr, "error: %s\n", Error.c_str());
+    return 1;
+  }
+
+  return 0;
+}
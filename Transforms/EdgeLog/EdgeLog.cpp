@@ -13,67 +13,1022 @@
 /// Unlike AFL, these are not "lossy" statistics (e.g., counts): they are exact,
 /// so should not be used where performance is a requirement.
 ///
+/// Each basic block is assigned an ID that is stable across builds (and
+/// independent of where the code is loaded): the upper 32 bits are a hash of
+/// the module's source file name, and the lower 32 bits are a hash of the
+/// function's name plus the block's index in the function. The ID is passed to
+/// the runtime, and a map of IDs back to functions, blocks and source locations
+/// is (optionally) written alongside the object file.
+///
+/// By default each block calls into the runtime. With `-edge-log-inline`, the
+/// block's ID is instead appended to the thread's buffer inline, and the
+/// runtime is only called when the buffer is full, or when the thread last
+/// logged in another generation (e.g., before logging was stopped, in which
+/// case the runtime drops the block). The thread's logging state is a single
+/// initial-exec thread-local, whose address each function computes once
+/// (rather than each block, through the GOT and the thread pointer), except
+/// coroutines, which may be resumed on another thread.
+///
+/// With `-edge-log-toggle`, each block first checks whether logging is started
+/// (a load of a global and a branch), so that the program runs at nearly full
+/// speed while logging is stopped. The logging code is laid out as the
+/// unlikely path.
+///
+/// With `-edge-log-prune`, blocks whose execution is implied by their
+/// successor are not logged. Such a block has a single successor, which has it
+/// as its single predecessor (i.e., the block immediately dominates its
+/// successor, which immediately post-dominates it), and makes no calls (so
+/// that nothing else is logged between the two). The block map records which
+/// block implies each pruned block, so that the edge sequence can be restored.
+/// SimplifyCFG merges such pairs of blocks, so at the end of an optimized
+/// pipeline there are few left to prune: pruning is mostly useful with
+/// `-edge-log-early`, where it also lets the optimizer merge the pruned blocks.
+///
+/// With `-edge-log-mode=counts`, the sequence of executed blocks is not logged.
+/// Instead, edges in the control-flow graph (and function entries) are given
+/// 64-bit counters in a per-module array, which the runtime writes at exit.
+/// Counters are placed at the end of the edge's source block (if it has a
+/// single successor), the start of its destination (if it has a single
+/// predecessor), or in a new block on the (split) edge.
+///
+/// Only edges that are not on a maximum spanning tree of each function's CFG
+/// (weighted by block frequency, and extended with a virtual block linking
+/// the function's entry and exits) are counted. The runtime derives the counts
+/// of the remaining edges by flow conservation (i.e., a block is left as many
+/// times as it is entered).
+///
+/// `-edge-log-allowlist` and `-edge-log-denylist` restrict instrumentation to
+/// some functions, given special case lists (as used by the sanitizers) of
+/// source files (`src:`) and (mangled) function names (`fun:`). Entries in an
+/// `[edge-log]` section, or in no section, apply. With an allowlist, a
+/// function is only instrumented if both its module's source file and its name
+/// are listed. A function is not instrumented if either is denylisted.
+/// Uninstrumented functions are given no block IDs, and are invisible to the
+/// log.
+///
+/// The pass runs under both the legacy and (with LLVM 12 or later) the new
+/// pass manager (e.g., `clang -fpass-plugin`). By default it runs at the end of
+/// the optimization pipeline, so that the optimizer does not disturb the
+/// instrumentation. With `-edge-log-early`, it instead runs at the start of
+/// the pipeline (with the legacy pass manager, at the start of module
+/// optimization), so that the optimizer can clean up the instrumentation
+/// (e.g., by hoisting and combining loads of the runtime's thread-locals).
+/// Blocks are then identified before (and may be duplicated by) optimization.
+///
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#if LLVM_VERSION_MAJOR >= 12
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#endif
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SpecialCaseList.h"
+#if LLVM_VERSION_MAJOR >= 10
+#include "llvm/Support/VirtualFileSystem.h"
+#endif
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Instrumentation.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <algorithm>
 
 using namespace llvm;
 
 #define DEBUG_TYPE "edge-log"
 
+STATISTIC(NumEdges, "Number of control-flow edges in counts mode");
+STATISTIC(NumCounters, "Number of edge counters");
+
+static cl::opt<std::string>
+    ClMapDir("edge-log-map-dir",
+             cl::desc("Directory to write basic block ID maps to (defaults "
+                      "to $EDGE_LOG_MAP_DIR)"));
+
+enum class LogMode { Trace, Counts };
+
+static cl::opt<LogMode> ClMode(
+    "edge-log-mode", cl::desc("What to log"),
+    cl::values(clEnumValN(LogMode::Trace, "trace",
+                          "Log the sequence of executed basic blocks"),
+               clEnumValN(LogMode::Counts, "counts",
+                          "Count executions of each control-flow edge")),
+    cl::init(LogMode::Trace));
+
+static cl::opt<bool>
+    ClInline("edge-log-inline",
+             cl::desc("Append to the runtime's edge buffer inline, rather "
+                      "than calling into the runtime for every block"),
+             cl::init(false));
+
+static cl::opt<bool> ClSpanningTree(
+    "edge-log-spanning-tree",
+    cl::desc("In counts mode, only count edges that are not on a maximum "
+             "spanning tree of the CFG"),
+    cl::init(true));
+
+static cl::opt<bool>
+    ClToggle("edge-log-toggle",
+             cl::desc("In trace mode, only log blocks while logging is "
+                      "started (see __edge_log_start)"),
+             cl::init(false));
+
+static cl::opt<bool>
+    ClPrune("edge-log-prune",
+            cl::desc("Do not log blocks whose execution is implied by their "
+                     "successor (requires a block map to decode the log). "
+                     "The optimizer merges most such blocks, so this is "
+                     "mostly useful with -edge-log-early"),
+            cl::init(false));
+
+static cl::list<std::string> ClAllowlist(
+    "edge-log-allowlist",
+    cl::desc("Special case list of functions and source files to instrument "
+             "(all, if not given)"),
+    cl::ZeroOrMore);
+
+static cl::list<std::string>
+    ClDenylist("edge-log-denylist",
+               cl::desc("Special case list of functions and source files not "
+                        "to instrument"),
+               cl::ZeroOrMore);
+
+static cl::opt<bool>
+    ClEarly("edge-log-early",
+            cl::desc("Instrument at the start of the optimization pipeline, "
+                     "rather than at its end"),
+            cl::init(false));
+
 namespace {
 
 static const char *const kEdgeLogFuncName = "__edge_log";
+static const char *const kThreadVarName = "__edge_log_thread";
+static const char *const kGenerationVarName = "__edge_log_generation";
+static const char *const kRegisterCountersFuncName =
+    "__edge_log_register_counters";
+static const char *const kCountersCtorName = "edge_log.module_ctor";
+static const char *const kMapDirEnv = "EDGE_LOG_MAP_DIR";
+
+/// Section of the allow/denylists that applies to the pass
+static const char *const kListSection = "edge-log";
+
+/// Fields of the runtime's per-thread state (`ThreadState`) accessed by inline
+/// instrumentation
+enum ThreadField { TF_Cursor, TF_End, TF_Generation };
 
-class EdgeLog : public ModulePass {
+/// Step used to find a free range of IDs for a function whose hash collides
+/// with another function in the same module
+static const uint32_t kProbeStep = 0x9e3779b9;
+
+/// Branch weight of the inline fast path, relative to the runtime call
+static const uint32_t kFastPathWeight = 1 << 16;
+
+/// Branch weight of skipping a block while logging is stopped, relative to
+/// logging it
+static const uint32_t kStoppedWeight = 1 << 10;
+
+/// Priority of the constructor that registers a module's counters
+static const int kCtorPriority = 1;
+
+/// An edge that may be counted. A null `Src` is the function's entry, and a
+/// null `Dst` is an exit from the function (via a block without successors).
+struct CountedEdge {
+  BasicBlock *Src;
+  BasicBlock *Dst;
+  uint64_t Weight;
+  bool Countable;
+  bool InTree;
+};
+
+/// A basic block's ID and where it came from
+struct BlockInfo {
+  uint64_t ID;
+  BasicBlock *BB;
+  const Function *F;
+  unsigned Index;
+  const DILocation *Loc;
+  /// ID of the block that implies this block's execution (0 if the block is
+  /// logged)
+  uint64_t ImpliedBy;
+};
+
+/// Instruments a module, independently of the pass manager
+class EdgeLog {
+public:
+  using BFIGetter = function_ref<BlockFrequencyInfo &(Function &)>;
+
+  explicit EdgeLog(BFIGetter GetBFI) : GetBFI(GetBFI) {}
+
+  bool instrumentModule(Module &M);
+
+private:
+  bool shouldInstrument(const Module &M, const Function &F) const;
+  void pruneBlocks(MutableArrayRef<BlockInfo> Blocks) const;
+  void instrumentTrace(Module &M, ArrayRef<BlockInfo> Blocks) const;
+  void instrumentCounts(Module &M, ArrayRef<BlockInfo> Blocks);
+  void getCountedEdges(ArrayRef<BlockInfo> Blocks,
+                       SmallVectorImpl<CountedEdge> &Edges);
+  void writeMap(StringRef ModulePath, uint32_t ModuleHash,
+                ArrayRef<BlockInfo> Blocks) const;
+
+  BFIGetter GetBFI;
+  std::unique_ptr<SpecialCaseList> Allowlist;
+  std::unique_ptr<SpecialCaseList> Denylist;
+};
+
+class EdgeLogLegacyPass : public ModulePass {
 public:
   static char ID;
-  EdgeLog() : ModulePass(ID) {}
+  EdgeLogLegacyPass() : ModulePass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    // Block frequencies are only used to build spanning trees
+    if (ClMode == LogMode::Counts && ClSpanningTree) {
+      AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    }
+  }
+
+  bool runOnModule(Module &M) override {
+    auto GetBFI = [this](Function &F) -> BlockFrequencyInfo & {
+      return getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI();
+    };
+    return EdgeLog(GetBFI).instrumentModule(M);
+  }
+};
 
-  bool runOnModule(Module &) override;
+#if LLVM_VERSION_MAJOR >= 12
+class EdgeLogPass : public PassInfoMixin<EdgeLogPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM =
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    auto GetBFI = [&FAM](Function &F) -> BlockFrequencyInfo & {
+      return FAM.getResult<BlockFrequencyAnalysis>(F);
+    };
+    return EdgeLog(GetBFI).instrumentModule(M) ? PreservedAnalyses::none()
+                                               : PreservedAnalyses::all();
+  }
+
+  /// Run even at -O0, and on `optnone` functions
+  static bool isRequired() { return true; }
 };
+#endif
 
 } // anonymous namespace
 
-char EdgeLog::ID = 0;
+char EdgeLogLegacyPass::ID = 0;
+
+static uint32_t Hash32(StringRef S) {
+  MD5 Hash;
+  MD5::MD5Result Result;
+
+  Hash.update(S);
+  Hash.final(Result);
+  return static_cast<uint32_t>(Result.low());
+}
+
+/// Return the path identifying `M`: its source file's canonical path (or its
+/// absolute path, if the source file cannot be found), so that modules compiled
+/// from files with the same (relative) name in different directories differ
+static std::string GetModulePath(const Module &M) {
+  SmallString<256> Path;
+  if (!sys::fs::real_path(M.getSourceFileName(), Path)) {
+    return std::string(Path);
+  }
+
+  Path = M.getSourceFileName();
+  sys::fs::make_absolute(Path);
+  sys::path::remove_dots(Path, /* remove_dot_dot */ true);
+  return std::string(Path);
+}
+
+/// Quote a CSV field (if necessary)
+static std::string QuoteCSV(StringRef Field) {
+  if (Field.find_first_of(",\"\r\n") == StringRef::npos) {
+    return std::string(Field);
+  }
+
+  std::string Result = "\"";
+  for (char C : Field) {
+    if (C == '"') {
+      Result += '"';
+    }
+    Result += C;
+  }
+  return Result + "\"";
+}
+
+/// Return the module (second) field of the first row of the block map at
+/// `Path`, or an empty string if there is no such map
+static std::string ReadMapModule(StringRef Path) {
+  auto Buf = MemoryBuffer::getFile(Path);
+  if (!Buf) {
+    return "";
+  }
+
+  // Skip the header and the `id` field
+  StringRef Row = (*Buf)->getBuffer().split('\n').second.split(',').second;
+  if (!Row.consume_front("\"")) {
+    return std::string(Row.split(',').first);
+  }
+
+  std::string Module;
+  for (size_t I = 0; I < Row.size() && (Row[I] != '"' || Row[I + 1] == '"');
+       ++I) {
+    Module += Row[I];
+    I += Row[I] == '"';
+  }
+  return Module;
+}
+
+static GlobalVariable *GetThreadLocal(Module &M, StringRef Name, Type *Ty) {
+  if (GlobalVariable *GV = M.getNamedGlobal(Name)) {
+    return GV;
+  }
+
+  // The runtime is linked into the executable, so its thread-locals are at a
+  // fixed offset from the thread pointer
+  return new GlobalVariable(M, Ty, /* isConstant */ false,
+                            GlobalValue::ExternalLinkage, nullptr, Name,
+                            nullptr, GlobalVariable::InitialExecTLSModel);
+}
+
+/// Compute the address of the thread-local `Var` at the start of `F`. Code
+/// generation would otherwise recompute it in each block that uses it, so it
+/// is passed through an (empty) inline asm, which keeps it in a register.
+static Value *GetThreadLocalAddress(Function &F, GlobalVariable *Var) {
+  IRBuilder<> IRB(&*F.getEntryBlock().getFirstInsertionPt());
+  Type *Ty = Var->getType();
+  InlineAsm *Opaque =
+      InlineAsm::get(FunctionType::get(Ty, {Ty}, /* isVarArg */ false), "",
+                     "=r,0", /* hasSideEffects */ false);
+  return IRB.CreateCall(Opaque, {Var});
+}
+
+static const DILocation *GetLocation(const BasicBlock &BB) {
+  for (const auto &I : BB) {
+    if (const DILocation *Loc = I.getDebugLoc()) {
+      return Loc;
+    }
+  }
+  return nullptr;
+}
+
+void EdgeLog::writeMap(StringRef ModulePath, uint32_t ModuleHash,
+                       ArrayRef<BlockInfo> Blocks) const {
+  std::string Dir = ClMapDir;
+  if (Dir.empty()) {
+    if (const char *EnvDir = getenv(kMapDirEnv)) {
+      Dir = EnvDir;
+    }
+  }
+  if (Dir.empty()) {
+    return;
+  }
+
+  char Name[16];
+  snprintf(Name, sizeof(Name), "%08x.csv", ModuleHash);
+
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, Name);
+
+  // The map of a module is rewritten each time it is compiled, but another
+  // module with the same hash has the same block IDs
+  const std::string Other = ReadMapModule(Path);
+  if (!Other.empty() && Other != ModulePath) {
+    errs() << "edge-log: block IDs of " << ModulePath << " collide with those "
+           << "of " << Other << " (module hash "
+           << format_hex_no_prefix(ModuleHash, 8) << ")\n";
+  }
+
+  std::error_code EC;
+#if LLVM_VERSION_MAJOR >= 9
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+#else
+  raw_fd_ostream OS(Path, EC, sys::fs::F_Text);
+#endif
+  if (EC) {
+    errs() << "edge-log: unable to write block map " << Path << ": "
+           << EC.message() << '\n';
+    return;
+  }
 
-bool EdgeLog::runOnModule(Module &M) {
+  OS << "id,module,function,block,file,line,column,implied_by\n";
+  for (const auto &Block : Blocks) {
+    OS << Block.ID << ',' << QuoteCSV(ModulePath) << ','
+       << QuoteCSV(Block.F->getName()) << ',' << Block.Index << ',';
+    if (Block.Loc) {
+      OS << QuoteCSV(Block.Loc->getFilename()) << ',' << Block.Loc->getLine()
+         << ',' << Block.Loc->getColumn();
+    } else {
+      OS << ",0,0";
+    }
+    OS << ',';
+    if (Block.ImpliedBy) {
+      OS << Block.ImpliedBy;
+    }
+    OS << '\n';
+  }
+}
+
+/// Return true if `BB` calls a function (which may log blocks of its own, or
+/// never return)
+static bool HasCalls(const BasicBlock &BB) {
+  for (const auto &I : BB) {
+    if (isa<CallBase>(I) && !isa<IntrinsicInst>(I)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Return true if `F` is a coroutine that has not been split yet (i.e., it has
+/// suspend points, after which it may be resumed on another thread). Not
+/// relying on `Function::isPresplitCoroutine`, as coroutines are only marked
+/// as such by CoroEarly, which runs after `-edge-log-early`.
+static bool IsPresplitCoroutine(const Function &F) {
+  for (const auto &BB : F) {
+    for (const auto &I : BB) {
+      const auto *CB = dyn_cast<CallBase>(&I);
+      const Function *Callee = CB ? CB->getCalledFunction() : nullptr;
+      if (Callee && Callee->getName().startswith("llvm.coro.suspend")) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void EdgeLog::pruneBlocks(MutableArrayRef<BlockInfo> Blocks) const {
+  DenseMap<const BasicBlock *, uint64_t> IDs;
+  for (const auto &Block : Blocks) {
+    IDs[Block.BB] = Block.ID;
+  }
+
+  // Pruned blocks may form a cycle only if it is unreachable, so restoring the
+  // blocks implied by a logged block always terminates
+  for (auto &Block : Blocks) {
+    const BasicBlock *Succ = Block.BB->getUniqueSuccessor();
+    if (Succ && Succ != Block.BB && Succ->getUniquePredecessor() == Block.BB &&
+        !HasCalls(*Block.BB)) {
+      Block.ImpliedBy = IDs.lookup(Succ);
+    }
+  }
+}
+
+void EdgeLog::instrumentTrace(Module &M, ArrayRef<BlockInfo> Blocks) const {
   LLVMContext &C = M.getContext();
-  bool Modifed = false;
+  IntegerType *Int32Ty = Type::getInt32Ty(C);
+  IntegerType *Int64Ty = Type::getInt64Ty(C);
+  PointerType *Int64PtrTy = Int64Ty->getPointerTo();
 
   auto LogEdgeF = M.getOrInsertFunction(
       kEdgeLogFuncName,
-      FunctionType::get(Type::getVoidTy(C), /* isVarArg */ false));
+      FunctionType::get(Type::getVoidTy(C), {Int64Ty}, /* isVarArg */ false));
+
+  // Only the leading fields of the runtime's `ThreadState` are declared
+  StructType *ThreadTy = StructType::get(Int64PtrTy, Int64PtrTy, Int32Ty);
+  GlobalVariable *ThreadVar = nullptr;
+  if (ClInline) {
+    ThreadVar = GetThreadLocal(M, kThreadVarName, ThreadTy);
+  }
+
+  // Inline logging checks the generation even without `-edge-log-toggle`, so
+  // that it stops when logging is stopped
+  Constant *GenerationVar = nullptr;
+  if (ClToggle || ClInline) {
+    GenerationVar = M.getOrInsertGlobal(kGenerationVarName, Int32Ty);
+  }
+
+  const Function *CurF = nullptr;
+  Value *Thread = nullptr;
+  for (const auto &Block : Blocks) {
+    if (Block.ImpliedBy) {
+      continue;
+    }
+
+    // The entry block's static allocas must stay in it (ahead of where it is
+    // split), or they are no longer promoted to registers. The address of the
+    // thread's state is computed at the very start of the entry block, ahead
+    // of its instrumentation. A coroutine's frame may be resumed on another
+    // thread, so the address is not kept across its suspend points (it is
+    // recomputed at each use).
+    BasicBlock::iterator IPIt = Block.BB->getFirstInsertionPt();
+    if (Block.BB == &Block.BB->getParent()->getEntryBlock()) {
+      IPIt = PrepareToSplitEntryBlock(*Block.BB, IPIt);
+    }
+    Instruction *IP = &*IPIt;
+    if (ClInline && Block.F != CurF) {
+      CurF = Block.F;
+      Thread = IsPresplitCoroutine(*CurF)
+                   ? ThreadVar
+                   : GetThreadLocalAddress(*Block.BB->getParent(), ThreadVar);
+    }
+    Constant *BlockID = ConstantInt::get(Int64Ty, Block.ID);
+
+    // The generation is loaded atomically, so that the load is not hoisted out
+    // of loops
+    LoadInst *Generation = nullptr;
+    if (GenerationVar) {
+      IRBuilder<> IRB(IP);
+#if LLVM_VERSION_MAJOR >= 11
+      Generation = IRB.CreateLoad(Int32Ty, GenerationVar);
+#else
+      Generation = IRB.CreateAlignedLoad(Int32Ty, GenerationVar, 4);
+#endif
+      Generation->setAtomic(AtomicOrdering::Monotonic);
+    }
+
+    // Skip the block while logging is stopped
+    if (ClToggle) {
+      IRBuilder<> IRB(IP);
+      IP = SplitBlockAndInsertIfThen(
+          IRB.CreateIsNotNull(Generation), IP, /* Unreachable */ false,
+          MDBuilder(C).createBranchWeights(1, kStoppedWeight));
+    }
+
+    if (!ClInline) {
+      IRBuilder<> IRB(IP);
+      IRB.CreateCall(LogEdgeF, {BlockID});
+      continue;
+    }
+
+    IRBuilder<> IRB(IP);
+    Value *CursorPtr = IRB.CreateStructGEP(ThreadTy, Thread, TF_Cursor);
+    Value *Cursor = IRB.CreateLoad(Int64PtrTy, CursorPtr);
+    Value *End = IRB.CreateLoad(
+        Int64PtrTy, IRB.CreateStructGEP(ThreadTy, Thread, TF_End));
+    Value *Full = IRB.CreateICmpEQ(Cursor, End);
+
+    // Call into the runtime if the thread last logged in another generation
+    // (e.g., before logging was stopped or restarted), so that it can drop the
+    // block or end the thread's sequence of blocks
+    Value *ThreadGeneration = IRB.CreateLoad(
+        Int32Ty, IRB.CreateStructGEP(ThreadTy, Thread, TF_Generation));
+    Full = IRB.CreateOr(Full, IRB.CreateICmpNE(ThreadGeneration, Generation));
+
+    Instruction *SlowTerm, *FastTerm;
+    SplitBlockAndInsertIfThenElse(
+        Full, IP, &SlowTerm, &FastTerm,
+        MDBuilder(C).createBranchWeights(1, kFastPathWeight));
+
+    IRBuilder<> SlowIRB(SlowTerm);
+    SlowIRB.CreateCall(LogEdgeF, {BlockID});
+
+    IRBuilder<> FastIRB(FastTerm);
+    FastIRB.CreateStore(BlockID, Cursor);
+    FastIRB.CreateStore(FastIRB.CreateConstInBoundsGEP1_32(Int64Ty, Cursor, 1),
+                        CursorPtr);
+  }
+}
+
+/// Return true if `BB` calls a function that may not return to it (e.g., one
+/// that throws, calls `exit` or `longjmp`s)
+static bool MayNotReturn(const BasicBlock *BB) {
+  return any_of(*BB, [](const Instruction &I) {
+    return isa<CallBase>(I) && !isa<IntrinsicInst>(I) &&
+           !isGuaranteedToTransferExecutionToSuccessor(&I);
+  });
+}
+
+/// Return true if a counter can be placed on the edge from `Src` to `Dst`
+/// (see `GetCounterSite`)
+static bool IsCountable(const BasicBlock *Src, const BasicBlock *Dst) {
+  if (!Src || !Dst) {
+    const BasicBlock *BB = Src ? Src : Dst;
+    return BB->getFirstInsertionPt() != BB->end();
+  }
+  if (Src->getUniqueSuccessor() == Dst) {
+    return true;
+  }
+  if (Dst->getUniquePredecessor() == Src) {
+    return Dst->getFirstInsertionPt() != Dst->end();
+  }
+
+  // Critical edges from indirect branches or into exception handling pads
+  // cannot be split
+  const Instruction *TI = Src->getTerminator();
+  return !isa<IndirectBrInst>(TI) && !isa<CallBrInst>(TI) && !Dst->isEHPad();
+}
+
+/// Return where to count `E`, splitting it if necessary
+static Instruction *GetCounterSite(const CountedEdge &E) {
+  if (!E.Src) {
+    return &*E.Dst->getFirstInsertionPt();
+  }
+  if (!E.Dst) {
+    // Count the block's entries, as it may never reach its terminator (e.g.,
+    // if it calls a function that does not return)
+    return &*E.Src->getFirstInsertionPt();
+  }
+  if (E.Src->getUniqueSuccessor() == E.Dst) {
+    return E.Src->getTerminator();
+  }
+  if (E.Dst->getUniquePredecessor() == E.Src) {
+    return &*E.Dst->getFirstInsertionPt();
+  }
+
+  BasicBlock *Split = SplitCriticalEdge(
+      E.Src, E.Dst, CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+  return Split ? Split->getTerminator() : nullptr;
+}
+
+void EdgeLog::getCountedEdges(ArrayRef<BlockInfo> Blocks,
+                              SmallVectorImpl<CountedEdge> &Edges) {
+  Function &F = *Blocks.front().BB->getParent();
+  const BlockFrequencyInfo *BFI = nullptr;
+  const BranchProbabilityInfo *BPI = nullptr;
+  if (ClSpanningTree) {
+    BFI = &GetBFI(F);
+    BPI = BFI->getBPI();
+  }
+
+  auto Freq = [&](const BasicBlock *BB) -> uint64_t {
+    return BFI ? BFI->getBlockFreq(BB).getFrequency() : 0;
+  };
+
+  const size_t FirstEdge = Edges.size();
+  BasicBlock *Entry = &F.getEntryBlock();
+  Edges.push_back({nullptr, Entry, Freq(Entry), true, false});
+
+  for (const auto &Block : Blocks) {
+    BasicBlock *Src = Block.BB;
+    const SmallSetVector<BasicBlock *, 4> Succs(succ_begin(Src),
+                                                succ_end(Src));
+    for (BasicBlock *Dst : Succs) {
+      const uint64_t Weight =
+          BPI ? BPI->getEdgeProbability(Src, Dst).scale(Freq(Src)) : 0;
+      Edges.push_back({Src, Dst, Weight, IsCountable(Src, Dst), false});
+    }
+    if (Succs.empty() && ClSpanningTree) {
+      Edges.push_back(
+          {Src, nullptr, Freq(Src), IsCountable(Src, nullptr), false});
+    } else if (ClSpanningTree && MayNotReturn(Src)) {
+      // As in gcov, a block that may leave the function via a call gets a
+      // (fake) edge to the function's exit. It cannot be counted, so it is
+      // placed on the tree and its count derived, keeping each block
+      // balanced.
+      Edges.push_back({Src, nullptr, 0, false, false});
+    }
+  }
+
+  if (!ClSpanningTree) {
+    return;
+  }
+
+  // Build a maximum spanning tree (with Kruskal's algorithm) over the CFG,
+  // plus a virtual block (with index `Blocks.size()`) that the function's
+  // entry and exits are connected to. Edges that cannot be counted must be on
+  // the tree.
+  DenseMap<const BasicBlock *, unsigned> Indices;
+  for (unsigned I = 0; I < Blocks.size(); ++I) {
+    Indices[Blocks[I].BB] = I;
+  }
+
+  auto Index = [&](const BasicBlock *BB) {
+    return BB ? Indices.lookup(BB) : Blocks.size();
+  };
+
+  SmallVector<unsigned, 64> Parents(Blocks.size() + 1);
+  for (unsigned I = 0; I < Parents.size(); ++I) {
+    Parents[I] = I;
+  }
+
+  auto Find = [&](unsigned I) {
+    while (Parents[I] != I) {
+      I = Parents[I] = Parents[Parents[I]];
+    }
+    return I;
+  };
+
+  auto FuncEdges = MutableArrayRef<CountedEdge>(Edges).drop_front(FirstEdge);
+  SmallVector<CountedEdge *, 64> Sorted;
+  for (auto &E : FuncEdges) {
+    Sorted.push_back(&E);
+  }
+  std::stable_sort(Sorted.begin(), Sorted.end(),
+                   [](const CountedEdge *A, const CountedEdge *B) {
+                     if (A->Countable != B->Countable) {
+                       return !A->Countable;
+                     }
+                     return A->Weight > B->Weight;
+                   });
+
+  bool Complete = true;
+  for (CountedEdge *E : Sorted) {
+    const unsigned SrcRoot = Find(Index(E->Src));
+    const unsigned DstRoot = Find(Index(E->Dst));
+    if (SrcRoot != DstRoot) {
+      Parents[SrcRoot] = DstRoot;
+      E->InTree = true;
+    } else if (!E->Countable) {
+      Complete = false;
+    }
+  }
+
+  // If an edge that cannot be counted is not on the tree, the counts of the
+  // tree edges cannot be derived. Count every (countable) edge instead.
+  if (!Complete) {
+    Edges.erase(
+        std::remove_if(Edges.begin() + FirstEdge, Edges.end(),
+                       [](const CountedEdge &E) { return !E.Dst; }),
+        Edges.end());
+    for (auto &E : MutableArrayRef<CountedEdge>(Edges).drop_front(FirstEdge)) {
+      E.InTree = false;
+    }
+  }
+}
+
+void EdgeLog::instrumentCounts(Module &M, ArrayRef<BlockInfo> Blocks) {
+  LLVMContext &C = M.getContext();
+  IntegerType *Int64Ty = Type::getInt64Ty(C);
+  PointerType *Int64PtrTy = Int64Ty->getPointerTo();
+
+  // Find the edges (and function entries and exits) to count. Blocks are
+  // grouped by function.
+  SmallVector<CountedEdge, 512> CFGEdges;
+  for (auto I = Blocks.begin(); I != Blocks.end();) {
+    auto E = std::find_if(I, Blocks.end(),
+                          [&](const BlockInfo &B) { return B.F != I->F; });
+    getCountedEdges(makeArrayRef(I, E), CFGEdges);
+    I = E;
+  }
+
+  DenseMap<const BasicBlock *, uint64_t> IDs;
+  for (const auto &Block : Blocks) {
+    IDs[Block.BB] = Block.ID;
+  }
+
+  // Place counters on edges off the spanning trees (splitting critical edges
+  // where necessary), and list the counted edges before the tree edges. Edges
+  // are identified by their (source, destination) IDs, where ID 0 is a
+  // function's entry or exit.
+  SmallVector<Instruction *, 256> Sites;
+  SmallVector<uint64_t, 512> EdgeIDs;
+  SmallVector<uint64_t, 512> TreeEdgeIDs;
+
+  for (const auto &E : CFGEdges) {
+    const uint64_t SrcID = IDs.lookup(E.Src);
+    const uint64_t DstID = IDs.lookup(E.Dst);
+
+    if (E.InTree) {
+      TreeEdgeIDs.append({SrcID, DstID});
+      continue;
+    }
+
+    // Edges that cannot be split (e.g., from indirect branches or into
+    // exception handling pads) are not counted
+    if (!E.Countable) {
+      continue;
+    }
+    if (Instruction *IP = GetCounterSite(E)) {
+      Sites.push_back(IP);
+      EdgeIDs.append({SrcID, DstID});
+    }
+  }
+
+  NumEdges += EdgeIDs.size() / 2 + TreeEdgeIDs.size() / 2;
+  NumCounters += Sites.size();
+
+  if (Sites.empty()) {
+    return;
+  }
+
+  ArrayType *CountersTy = ArrayType::get(Int64Ty, Sites.size());
+  auto *Counters = new GlobalVariable(
+      M, CountersTy, /* isConstant */ false, GlobalValue::PrivateLinkage,
+      Constant::getNullValue(CountersTy), "__edge_log_counters");
+
+  const uint64_t NumCountedEdges = Sites.size();
+  EdgeIDs.append(TreeEdgeIDs.begin(), TreeEdgeIDs.end());
+
+  Constant *EdgesInit = ConstantDataArray::get(C, EdgeIDs);
+  auto *Edges = new GlobalVariable(M, EdgesInit->getType(),
+                                   /* isConstant */ true,
+                                   GlobalValue::PrivateLinkage, EdgesInit,
+                                   "__edge_log_counter_edges");
+
+  for (unsigned I = 0; I < Sites.size(); ++I) {
+    IRBuilder<> IRB(Sites[I]);
+    Value *Counter = IRB.CreateConstInBoundsGEP2_64(CountersTy, Counters, 0, I);
+    Constant *One = ConstantInt::get(Int64Ty, 1);
+#if LLVM_VERSION_MAJOR >= 13
+    IRB.CreateAtomicRMW(AtomicRMWInst::Add, Counter, One, MaybeAlign(),
+                        AtomicOrdering::Monotonic);
+#else
+    IRB.CreateAtomicRMW(AtomicRMWInst::Add, Counter, One,
+                        AtomicOrdering::Monotonic);
+#endif
+  }
+
+  // Register the counters with the runtime on startup
+  auto RegisterCountersF = M.getOrInsertFunction(
+      kRegisterCountersFuncName,
+      FunctionType::get(Type::getVoidTy(C),
+                        {Int64PtrTy, Int64PtrTy, Int64Ty, Int64Ty},
+                        /* isVarArg */ false));
+
+  Function *Ctor = Function::Create(
+      FunctionType::get(Type::getVoidTy(C), /* isVarArg */ false),
+      GlobalValue::InternalLinkage, kCountersCtorName, &M);
+  IRBuilder<> IRB(BasicBlock::Create(C, "", Ctor));
+  IRB.CreateCall(RegisterCountersF,
+                 {IRB.CreateConstInBoundsGEP2_64(CountersTy, Counters, 0, 0),
+                  IRB.CreateConstInBoundsGEP2_64(EdgesInit->getType(), Edges,
+                                                 0, 0),
+                  ConstantInt::get(Int64Ty, NumCountedEdges),
+                  ConstantInt::get(Int64Ty, EdgeIDs.size() / 2)});
+  IRB.CreateRetVoid();
+
+  appendToGlobalCtors(M, Ctor, kCtorPriority);
+}
+
+static std::unique_ptr<SpecialCaseList>
+LoadSpecialCaseList(const std::vector<std::string> &Paths) {
+  if (Paths.empty()) {
+    return nullptr;
+  }
+#if LLVM_VERSION_MAJOR >= 10
+  return SpecialCaseList::createOrDie(Paths, *vfs::getRealFileSystem());
+#else
+  return SpecialCaseList::createOrDie(Paths);
+#endif
+}
+
+bool EdgeLog::shouldInstrument(const Module &M, const Function &F) const {
+  if (F.isDeclaration()) {
+    return false;
+  }
+
+  const StringRef Src = M.getSourceFileName();
+  if (Allowlist && (!Allowlist->inSection(kListSection, "src", Src) ||
+                    !Allowlist->inSection(kListSection, "fun", F.getName()))) {
+    return false;
+  }
+  if (Denylist && (Denylist->inSection(kListSection, "src", Src) ||
+                   Denylist->inSection(kListSection, "fun", F.getName()))) {
+    return false;
+  }
+  return true;
+}
+
+bool EdgeLog::instrumentModule(Module &M) {
+  // IDs 0 ("no previous block") and 1 (a break) are reserved, so the module
+  // hash must be non-zero
+  const std::string ModulePath = GetModulePath(M);
+  uint32_t ModuleHash = Hash32(ModulePath);
+  if (!ModuleHash) {
+    ModuleHash = 1;
+  }
+
+  // Malformed lists are a fatal error
+  Allowlist = LoadSpecialCaseList(ClAllowlist);
+  Denylist = LoadSpecialCaseList(ClDenylist);
+
+  DenseSet<uint32_t> UsedIDs;
+  SmallVector<BlockInfo, 256> Blocks;
 
   for (auto &F : M) {
+    if (!shouldInstrument(M, F)) {
+      continue;
+    }
+
+    // Find a range of IDs (one per block) not used by another function
+    const unsigned NumBlocks = F.size();
+    uint32_t FuncBase = Hash32(F.getName());
+    for (unsigned I = 0; I < NumBlocks;) {
+      if (UsedIDs.count(FuncBase + I)) {
+        FuncBase += kProbeStep;
+        I = 0;
+      } else {
+        ++I;
+      }
+    }
+
+    unsigned Index = 0;
     for (auto &BB : F) {
-      BasicBlock::iterator IP = BB.getFirstInsertionPt();
-      IRBuilder<> IRB(&*IP);
-      IRB.CreateCall(LogEdgeF);
+      const uint32_t LocalID = FuncBase + Index;
+      UsedIDs.insert(LocalID);
+      Blocks.push_back({static_cast<uint64_t>(ModuleHash) << 32 | LocalID, &BB,
+                        &F, Index, GetLocation(BB), 0});
+      ++Index;
+    }
+  }
+
+  if (Blocks.empty()) {
+    return false;
+  }
 
-      Modifed = true;
+  // IDs are assigned before instrumenting, which may split blocks
+  switch (ClMode) {
+  case LogMode::Trace:
+    if (ClPrune) {
+      pruneBlocks(Blocks);
     }
+    instrumentTrace(M, Blocks);
+    break;
+  case LogMode::Counts:
+    instrumentCounts(M, Blocks);
+    break;
   }
 
-  return Modifed;
+  writeMap(ModulePath, ModuleHash, Blocks);
+
+  return true;
 }
 
-static RegisterPass<EdgeLog> X("edge-log", "Executed edge statistics", false,
-                               false);
+static RegisterPass<EdgeLogLegacyPass> X("edge-log", "Executed edge statistics",
+                                         false, false);
 
 static void registerEdgeLog(const PassManagerBuilder &,
                             legacy::PassManagerBase &PM) {
-  PM.add(new EdgeLog());
+  PM.add(new EdgeLogLegacyPass());
+}
+
+static void registerEdgeLogEarly(const PassManagerBuilder &Builder,
+                                 legacy::PassManagerBase &PM) {
+  if (ClEarly) {
+    registerEdgeLog(Builder, PM);
+  }
+}
+
+static void registerEdgeLogLast(const PassManagerBuilder &Builder,
+                                legacy::PassManagerBase &PM) {
+  if (!ClEarly) {
+    registerEdgeLog(Builder, PM);
+  }
 }
 
 static RegisterStandardPasses
-    RegisterEdgeLog(PassManagerBuilder::EP_OptimizerLast, registerEdgeLog);
+    RegisterEdgeLogEarly(PassManagerBuilder::EP_ModuleOptimizerEarly,
+                         registerEdgeLogEarly);
+
+static RegisterStandardPasses
+    RegisterEdgeLog(PassManagerBuilder::EP_OptimizerLast, registerEdgeLogLast);
 
 static RegisterStandardPasses
     RegisterEdgeLog0(PassManagerBuilder::EP_EnabledOnOptLevel0,
                      registerEdgeLog);
+
+#if LLVM_VERSION_MAJOR >= 12
+#if LLVM_VERSION_MAJOR >= 14
+using OptLevel = OptimizationLevel;
+#else
+using OptLevel = PassBuilder::OptimizationLevel;
+#endif
+
+/// Entry point for the new pass manager (e.g., `clang -fpass-plugin` and
+/// `opt -load-pass-plugin`). The pass can also be run by name, with
+/// `opt -passes=edge-log`.
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "EdgeLog", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name != "edge-log") {
+                    return false;
+                  }
+                  MPM.addPass(EdgeLogPass());
+                  return true;
+                });
+
+            // The extension point depends on `-edge-log-early`
+            PB.registerPipelineStartEPCallback(
+                [](ModulePassManager &MPM, OptLevel) {
+                  if (ClEarly) {
+                    MPM.addPass(EdgeLogPass());
+                  }
+                });
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptLevel) {
+                  if (!ClEarly) {
+                    MPM.addPass(EdgeLogPass());
+                  }
+                });
+          }};
+}
+#endif
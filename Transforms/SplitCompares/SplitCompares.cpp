@@ -30,6 +30,11 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/IR/Module.h"
+#if LLVM_VERSION_MAJOR >= 12
+  #include "llvm/IR/PassManager.h"
+  #include "llvm/Passes/PassBuilder.h"
+  #include "llvm/Passes/PassPlugin.h"
+#endif
 
 #include "llvm/IR/IRBuilder.h"
 #if LLVM_VERSION_MAJOR > 3 || \
@@ -1179,3 +1184,63 @@ static RegisterStandardPasses RegisterSplitComparesPass(
 static RegisterStandardPasses RegisterSplitComparesTransPass0(
     PassManagerBuilder::EP_EnabledOnOptLevel0, registerSplitComparesPass);
 
+#if LLVM_VERSION_MAJOR >= 12
+namespace {
+
+/* New pass manager wrapper around the legacy pass, which needs no analyses */
+class SplitComparesPass : public PassInfoMixin<SplitComparesPass> {
+
+ public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+
+    SplitComparesTransform Pass;
+    return Pass.runOnModule(M) ? PreservedAnalyses::none()
+                               : PreservedAnalyses::all();
+
+  }
+
+  static bool isRequired() {
+
+    return true;
+
+  }
+
+};
+
+}  // namespace
+
+  #if LLVM_VERSION_MAJOR >= 14
+using OptLevel = OptimizationLevel;
+  #else
+using OptLevel = PassBuilder::OptimizationLevel;
+  #endif
+
+/* Entry point for the new pass manager (e.g., clang -fpass-plugin) */
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+
+  return {LLVM_PLUGIN_API_VERSION, "SplitCompares", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+
+                  if (Name != "split-compares") return false;
+                  MPM.addPass(SplitComparesPass());
+                  return true;
+
+                });
+
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptLevel) {
+
+                  MPM.addPass(SplitComparesPass());
+
+                });
+
+          }};
+
+}
+
+#endif
+
@@ -27,6 +27,11 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#if LLVM_VERSION_MAJOR >= 12
+  #include "llvm/IR/PassManager.h"
+  #include "llvm/Passes/PassBuilder.h"
+  #include "llvm/Passes/PassPlugin.h"
+#endif
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
@@ -433,3 +438,63 @@ static RegisterStandardPasses RegisterSplitSwitchesTransPass(
 static RegisterStandardPasses RegisterSplitSwitchesTransPass0(
     PassManagerBuilder::EP_EnabledOnOptLevel0, registerSplitSwitchesTransPass);
 
+#if LLVM_VERSION_MAJOR >= 12
+namespace {
+
+/* New pass manager wrapper around the legacy pass, which needs no analyses */
+class SplitSwitchesPass : public PassInfoMixin<SplitSwitchesPass> {
+
+ public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+
+    SplitSwitchesTransform Pass;
+    return Pass.runOnModule(M) ? PreservedAnalyses::none()
+                               : PreservedAnalyses::all();
+
+  }
+
+  static bool isRequired() {
+
+    return true;
+
+  }
+
+};
+
+}  // namespace
+
+  #if LLVM_VERSION_MAJOR >= 14
+using OptLevel = OptimizationLevel;
+  #else
+using OptLevel = PassBuilder::OptimizationLevel;
+  #endif
+
+/* Entry point for the new pass manager (e.g., clang -fpass-plugin) */
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+
+  return {LLVM_PLUGIN_API_VERSION, "SplitSwitches", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+
+                  if (Name != "split-switches") return false;
+                  MPM.addPass(SplitSwitchesPass());
+                  return true;
+
+                });
+
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptLevel) {
+
+                  MPM.addPass(SplitSwitchesPass());
+
+                });
+
+          }};
+
+}
+
+#endif
+
@@ -9,6 +9,7 @@ Author: Adrian Herrera
 
 import os
 from pathlib import Path
+import re
 from shutil import which
 from subprocess import run
 import sys
@@ -18,6 +19,14 @@ DIR = Path(__file__).parent
 LIB_DIR = DIR.parent  / 'lib'
 
 
+def clang_major_version(cc):
+    """Return the major version of clang `cc` (0 if unknown)."""
+    proc = run([cc, '--version'], capture_output=True, text=True,
+               check=False)
+    match = re.search(r'clang version (\d+)', proc.stdout)
+    return int(match.group(1)) if match else 0
+
+
 def main():
     """The main function."""
     args = sys.argv
@@ -42,7 +51,28 @@ def main():
     else:
         plugins = (LIB_DIR / 'edge-log.so',)
 
+    # -fplugin loads the plugins early enough for their options to be parsed,
+    # and runs them under the legacy pass manager. The new pass manager (the
+    # default from clang 13) only runs the plugins given to -fpass-plugin
     plugin_opts = ['-fplugin=%s' % plug.resolve() for plug in plugins]
+    if clang_major_version(cc) >= 12:
+        plugin_opts.extend(['-fpass-plugin=%s' % plug.resolve()
+                            for plug in plugins])
+    if env.get('LLVM_EDGE_LOG_INLINE'):
+        plugin_opts.extend(['-mllvm', '-edge-log-inline'])
+    if env.get('LLVM_EDGE_LOG_PRUNE'):
+        plugin_opts.extend(['-mllvm', '-edge-log-prune'])
+    if env.get('LLVM_EDGE_LOG_TOGGLE'):
+        plugin_opts.extend(['-mllvm', '-edge-log-toggle'])
+    if env.get('LLVM_EDGE_LOG_EARLY'):
+        plugin_opts.extend(['-mllvm', '-edge-log-early'])
+    if env.get('LLVM_EDGE_LOG_COUNTS'):
+        plugin_opts.extend(['-mllvm', '-edge-log-mode=counts'])
+    for var, opt in (('LLVM_EDGE_LOG_ALLOWLIST', '-edge-log-allowlist'),
+                     ('LLVM_EDGE_LOG_DENYLIST', '-edge-log-denylist')):
+        for path in env.get(var, '').split(os.pathsep):
+            if path:
+                plugin_opts.extend(['-mllvm', '%s=%s' % (opt, path)])
 
     # Determine build flags
     bit_mode = 32 if '-m32' in args else 64
@@ -55,7 +85,7 @@ def main():
     if len(args) > 1:
         run_args.extend([*args[1:]])
     if maybe_linking:
-        run_args.extend(['-lstdc++', '-ldl', '-lz',
+        run_args.extend(['-lstdc++', '-lz', '-lpthread',
                          '-L%s' % LIB_DIR, '-ledge-log-rt-%d' % bit_mode])
     proc = run(run_args, env=env, check=False)
 
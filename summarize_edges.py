@@ -10,6 +10,7 @@ Author: Adrian Herrera
 from argparse import ArgumentParser, Namespace
 from collections import defaultdict
 from csv import DictReader, DictWriter
+import gzip
 from pathlib import Path
 
 from tabulate import tabulate
@@ -20,47 +21,128 @@ def parse_args() -> Namespace:
     parser = ArgumentParser(description='Summarize executed edges')
     parser.add_argument('-c', '--csv', required=False, type=Path,
                         help='Path to output CSV')
+    parser.add_argument('-m', '--map-dir', required=False, type=Path,
+                        help='Path to the block maps (required to restore '
+                             'blocks pruned by -edge-log-prune)')
+    parser.add_argument('--merge', action='store_true',
+                        help='Merge the edges of all logs into a single '
+                             'table, with the number of logs each edge '
+                             'occurs in')
     parser.add_argument('log', nargs='+', type=Path,
                         help='Path to the edge log file(s)')
     return parser.parse_args()
 
 
+def load_implied_blocks(map_dir: Path) -> dict:
+    """
+    Map each block ID to the ID of the (unlogged) block executed immediately
+    before it, if any.
+    """
+    implied = {}
+    for map_path in map_dir.glob('*.csv'):
+        with open(map_path, 'r') as map_file:
+            for row in DictReader(map_file):
+                if row.get('implied_by'):
+                    implied[int(row['implied_by'])] = int(row['id'])
+    return implied
+
+
+def open_log(log_path: Path):
+    """
+    Open a log for reading. Logs written with `EDGE_LOG_GZIP` are decompressed
+    as they are read.
+    """
+    with open(log_path, 'rb') as log:
+        magic = log.read(2)
+    if magic == b'\x1f\x8b':
+        return gzip.open(log_path, 'rt')
+    return open(log_path, 'r')
+
+
+def expand_edge(prev: int, cur: int, implied: dict):
+    """Restore the unlogged blocks executed between `prev` and `cur`."""
+    blocks = [cur]
+    while blocks[-1] in implied:
+        blocks.append(implied[blocks[-1]])
+    blocks.append(prev)
+    blocks.reverse()
+    return zip(blocks, blocks[1:])
+
+
+def summarize_log(log_path: Path, implied: dict) -> dict:
+    """Count the edges executed in a log."""
+    result = defaultdict(int)
+    with open_log(log_path) as log:
+        # Read edge data (either a trace or edge counts)
+        reader = DictReader(log)
+        for row in reader:
+            count = int(row.get('count', 1))
+            edges = expand_edge(int(row['prev_id']), int(row['cur_id']),
+                                implied)
+            for key in edges:
+                result[key] += count
+    return result
+
+
+def merge(args: Namespace, implied: dict):
+    """Merge the edges of all logs into a single table, and print it."""
+    merged = defaultdict(lambda: [0, 0])
+    for log_path in args.log:
+        for key, count in summarize_log(log_path, implied).items():
+            merged[key][0] += count
+            merged[key][1] += 1
+
+    header = ('prev_id', 'cur_id', 'count', 'logs')
+    rows = sorted(merged.items())
+    csv_path = args.csv
+    if csv_path:
+        with open(csv_path, 'w') as csvfile:
+            writer = DictWriter(csvfile, fieldnames=header)
+            writer.writeheader()
+            writer.writerows({'prev_id': prev,
+                              'cur_id': cur,
+                              'count': count,
+                              'logs': logs}
+                             for (prev, cur), (count, logs) in rows)
+    else:
+        table = (('%#x' % prev, '%#x' % cur, count, logs)
+                 for (prev, cur), (count, logs) in rows)
+        print(tabulate(table, headers=header))
+
+
 def main():
     """The main function."""
     args = parse_args()
 
     # Collect results from logs
     results = defaultdict(lambda: defaultdict(int))
+    implied = load_implied_blocks(args.map_dir) if args.map_dir else {}
+
+    if args.merge:
+        merge(args, implied)
+        return
 
     for log_path in args.log:
-        with open(log_path, 'r') as log:
-            # Read edge data
-            reader = DictReader(log)
-            for row in reader:
-                key = (row['shared_object'], int(row['base_addr']),
-                       int(row['prev_addr']), int(row['cur_addr']))
-                results[log_path][key] += 1
+        for key, count in summarize_log(log_path, implied).items():
+            results[log_path][key] += count
 
     # Print results
-    header = ('log', 'shared_object', 'base_addr', 'prev_addr', 'cur_addr',
-              'count')
+    header = ('log', 'prev_id', 'cur_id', 'count')
     csv_path = args.csv
     if csv_path:
         with open(csv_path, 'w') as csvfile:
             writer = DictWriter(csvfile, fieldnames=header)
             writer.writeheader()
             writer.writerows({'log': str(log),
-                              'shared_object': so,
-                              'base_addr': base,
-                              'prev_addr': prev,
-                              'cur_addr': cur,
+                              'prev_id': prev,
+                              'cur_id': cur,
                               'count': count}
                              for log, result in results.items()
-                             for (so, base, prev, cur), count in result.items())
+                             for (prev, cur), count in result.items())
     else:
-        table = ((log, so, '%#x' % base, '%#x' % prev, '%#x' % cur, count)
+        table = ((log, '%#x' % prev, '%#x' % cur, count)
                  for log, result in results.items()
-                 for (so, base, prev, cur), count in result.items())
+                 for (prev, cur), count in result.items())
         print(tabulate(table, headers=header))
 
 